@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# plugin_bench.sh
+#
+# measures the cost per file of filemon when files are processed by a command (fork + exec of
+# /bin/sh -c true) and by a plugin which does nothing (sample_plugin.so without plugin-args).
+#
+# usage: plugin_bench.sh FILEMON SAMPLE_PLUGIN_SO [FILES]
+#
+# build:
+#   gcc -O2 main/src/filemon.c -o filemon -pthread -ldl
+#   gcc -shared -fPIC -O2 -I main/src main/plugins/sample_plugin.c -o sample_plugin.so
+#   main/bench/plugin_bench.sh ./filemon ./sample_plugin.so 20000
+
+set -e
+
+FILEMON=$(realpath "$1")
+PLUGIN=$(realpath "$2")
+FILES=${3:-10000}
+
+if [ ! -x "$FILEMON" ] || [ ! -f "$PLUGIN" ]; then
+	echo "usage: $0 FILEMON SAMPLE_PLUGIN_SO [FILES]" >&2
+	exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# prints the value of metric $1 in metrics file $2
+metric() {
+	awk -v name="$1" '$1 == name { print $2 }' "$2" 2>/dev/null
+}
+
+# CPU time (us) used by process $1 and by its children which have terminated
+cpu_us() {
+	local hz=$(getconf CLK_TCK)
+	awk -v hz="$hz" '{ sub(/.*\) /, ""); print int(($12 + $13 + $14 + $15) * 1000000 / hz) }' /proc/$1/stat
+}
+
+# runs filemon with the options in $@ on $FILES new files; prints the time from the first
+# file to the last job completed and the CPU time used by filemon and its handlers
+run() {
+	local dir="$WORK/in" metrics="$WORK/metrics"
+
+	rm -rf "$dir" "$metrics"
+	mkdir "$dir"
+
+	"$FILEMON" -d "$dir" --metrics-file "$metrics" "$@" 2>/dev/null &
+	local pid=$!
+
+	while [ ! -f "$metrics" ]; do sleep 0.1; done
+
+	local start=$(date +%s%N)
+
+	for ((i = 0; i < FILES; i++)); do
+		: > "$dir/f$i"
+	done
+
+	# the metrics file is written every second, so the end is known within 1 s whatever the
+	# polling interval: the wall time is an upper bound, the cpu time is exact
+	while [ "$(metric filemon_jobs_succeeded_total "$metrics")" != "$FILES" ]; do
+		sleep 0.1
+	done
+
+	local end=$(date +%s%N)
+	local cpu=$(cpu_us $pid)
+
+	kill $pid
+	wait $pid || true
+
+	echo $(( (end - start) / 1000 )) $cpu
+}
+
+report() {
+	awk -v path="$1" -v files="$FILES" -v wall="$2" -v cpu="$3" 'BEGIN {
+		printf "%-7s %8d files  wall %10.3f s  cpu %10.3f s  %10.2f us cpu/file\n",
+				path, files, wall / 1e6, cpu / 1e6, cpu / files
+	}'
+}
+
+report exec $(run -c true -j "$(nproc)")
+report plugin $(run --plugin "$PLUGIN")
+
+echo "wall time includes the creation of the files and the 1 s resolution of the metrics file;"
+echo "cpu time is used by filemon and its handlers, including the logging of each event"
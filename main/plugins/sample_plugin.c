@@ -0,0 +1,112 @@
+/*
+ * sample_plugin.c
+ *
+ * sample filemon plugin, see filemon_plugin.h.
+ *
+ * without plugin-args it does nothing and reports success for every file: it measures the
+ * cost of filemon itself (see bench/plugin_bench.sh).
+ * with --plugin-args FILE it appends a line "size path" for each file to FILE, with a single
+ * write() per batch.
+ *
+ * build:
+ *   gcc -shared -fPIC -O2 -Wall -I main/src main/plugins/sample_plugin.c -o sample_plugin.so
+ * run:
+ *   filemon -d /tmp/in --plugin ./sample_plugin.so --plugin-args /tmp/listing.txt
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "filemon_plugin.h"
+
+
+struct sample_state {
+	int listing_fd;             // -1 without plugin-args
+};
+
+static void * sample_init(const char * args, int * error)
+{
+	struct sample_state * st = calloc(1, sizeof(struct sample_state));
+
+	if (st == NULL) {
+		*error = ENOMEM;
+		return NULL;
+	}
+
+	st->listing_fd = -1;
+
+	if (args != NULL) {
+		// O_APPEND: the write() of each batch is not interleaved with the others
+		st->listing_fd = open(args, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (st->listing_fd == -1) {
+			*error = errno;
+			free(st);
+			return NULL;
+		}
+	}
+
+	return st;
+}
+
+static void sample_handle_batch(void * state, const struct filemon_event * events, size_t n, int * status)
+{
+	struct sample_state * st = state;
+
+	if (st->listing_fd == -1)
+		return;
+
+	size_t buf_size = n * (PATH_MAX + 32);
+	char * buf = malloc(buf_size);
+	size_t len = 0;
+
+	if (buf == NULL) {
+		for (size_t i = 0; i < n; i++)
+			status[i] = ENOMEM;
+		return;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		struct stat sb;
+		int res = events[i].fd != -1 ? fstat(events[i].fd, &sb) : stat(events[i].path, &sb);
+
+		if (res == -1) {
+			status[i] = errno;
+			continue;
+		}
+
+		len += snprintf(buf + len, buf_size - len, "%lld %s\n", (long long) sb.st_size, events[i].path);
+	}
+
+	if (len > 0 && write(st->listing_fd, buf, len) != (ssize_t) len) {
+		for (size_t i = 0; i < n; i++)
+			status[i] = EIO;
+	}
+
+	free(buf);
+}
+
+static void sample_shutdown(void * state)
+{
+	struct sample_state * st = state;
+
+	if (st->listing_fd != -1)
+		close(st->listing_fd);
+
+	free(st);
+}
+
+const struct filemon_plugin filemon_plugin = {
+		.abi_version = FILEMON_PLUGIN_ABI_VERSION,
+		.name = "sample",
+		.init = sample_init,
+		.handle_batch = sample_handle_batch,
+		.shutdown = sample_shutdown,
+};
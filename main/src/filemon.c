@@ -1,7 +1,7 @@
 /*
  ============================================================================
  Name        : filemon.c
- Author      : 
+ Author      :
  Version     :
  Copyright   : Marco Tessarotto (c) 2023
  Description : monitors one or more files or directories specified as parameters; when a new event is notified, invokes an action on the file.
@@ -17,6 +17,8 @@ gcc filemon.c -o filemon -s
  ============================================================================
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>  /* Type definitions used by many programs */
 #include <stdio.h>      /* Standard I/O functions */
 #include <stdlib.h>     /* Prototypes of commonly used library functions,
@@ -25,29 +27,6120 @@ gcc filemon.c -o filemon -s
 #include <errno.h>      /* Declares errno and defines error constants */
 #include <string.h>     /* Commonly used string-handling functions */
 #include <stdbool.h>    /* 'bool' type plus 'true' and 'false' constants */
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/inotify.h>
+#include <limits.h>
+
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <ctype.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <endian.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include <syslog.h>
+
+#include "filemon_plugin.h"
+
+
+typedef char * char_p;
+
+// on linux, PATH_MAX is 4096
+#define MAX_COMMAND_LEN (PATH_MAX*2)
+
+char *space = " ";
+char *slash = "/";
+
+const char * FILEMON = "filemon";
+
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+// maximum number of handlers running at the same time (-j)
+int max_jobs = 1;
+
+// when true, the AIMD controller moves concurrency_limit between 1 and max_jobs (--adaptive)
+bool adaptive = false;
+
+// current number of handlers allowed to run at the same time
+int concurrency_limit = 1;
+
+// controller targets: handler run time (ms, 0 = not used) and stall percentage of /proc/pressure/*
+long latency_target_ms = 0;
+double psi_target = 10.0;
+
+// metrics are written to this file every METRICS_PERIOD_MS (--metrics-file)
+char * metrics_file = NULL;
+
+// handlers are forked by the zygote process (--zygote)
+bool use_zygote = false;
+
+// CPU reserved to the thread which reads inotify events, -1 if not set (--reader-cpu)
+int reader_cpu = -1;
+
+// CPUs available to handlers whose rule has no cpus setting, when reader_cpu is set
+static cpu_set_t handler_cpus;
+
+// number of worker threads which run plugins, 0 = one per CPU (--workers)
+int workers = 0;
+
+// number of threads which read inotify events, each one with its own inotify instance;
+// 0 = events are read by monitor() (--readers)
+int readers = 0;
+
+// bytes of page cache used to read ahead the files of queued jobs, 0 = no read ahead (--prefetch)
+int64_t prefetch_budget = 0;
+
+#define AIMD_PERIOD_MS 1000
+#define METRICS_PERIOD_MS 1000
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+
+/*
+ * timers
+ *
+ * a binary min-heap of deadlines on CLOCK_MONOTONIC; monitor() sleeps in poll() until the
+ * earliest deadline and then runs the callbacks of all expired timers.
+ * a timer is armed at most once: arming it again moves its deadline.
+ */
+
+struct timer {
+	uint64_t deadline;              // CLOCK_MONOTONIC, ns
+	void (*fn)(struct timer * t);   // called once when deadline expires
+	void * arg;
+	int heap_pos;                   // position in timer_heap, -1 when not armed
+};
+
+#define TIMER_INIT(f, a) { .deadline = 0, .fn = (f), .arg = (a), .heap_pos = -1 }
+
+static struct timer ** timer_heap = NULL;
+static int timer_heap_len = 0;
+static int timer_heap_size = 0;
+
+static void timer_swap(int a, int b)
+{
+	struct timer * t = timer_heap[a];
+
+	timer_heap[a] = timer_heap[b];
+	timer_heap[b] = t;
+	timer_heap[a]->heap_pos = a;
+	timer_heap[b]->heap_pos = b;
+}
+
+static void timer_sift_up(int pos)
+{
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+
+		if (timer_heap[parent]->deadline <= timer_heap[pos]->deadline)
+			break;
+
+		timer_swap(parent, pos);
+		pos = parent;
+	}
+}
+
+static void timer_sift_down(int pos)
+{
+	for (;;) {
+		int left = 2 * pos + 1;
+		int smallest = pos;
+
+		if (left < timer_heap_len && timer_heap[left]->deadline < timer_heap[smallest]->deadline)
+			smallest = left;
+		if (left + 1 < timer_heap_len && timer_heap[left + 1]->deadline < timer_heap[smallest]->deadline)
+			smallest = left + 1;
+
+		if (smallest == pos)
+			break;
+
+		timer_swap(pos, smallest);
+		pos = smallest;
+	}
+}
+
+static void timer_cancel(struct timer * t)
+{
+	int pos = t->heap_pos;
+
+	if (pos < 0)
+		return;
+
+	timer_heap_len--;
+	if (pos != timer_heap_len) {
+		timer_heap[pos] = timer_heap[timer_heap_len];
+		timer_heap[pos]->heap_pos = pos;
+		timer_sift_up(pos);
+		timer_sift_down(timer_heap[pos]->heap_pos);
+	}
+
+	t->heap_pos = -1;
+}
+
+static void timer_arm(struct timer * t, uint64_t deadline)
+{
+	timer_cancel(t);
+
+	if (timer_heap_len >= timer_heap_size) {
+		timer_heap_size += 16;
+		timer_heap = realloc(timer_heap, sizeof(struct timer *) * timer_heap_size);
+		if (timer_heap == NULL) {
+			syslog(LOG_ERR, "cannot reallocate timer heap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	t->deadline = deadline;
+	t->heap_pos = timer_heap_len;
+	timer_heap[timer_heap_len++] = t;
+	timer_sift_up(t->heap_pos);
+}
+
+// returns the poll() timeout (ms) until the earliest deadline, -1 if no timer is armed
+static int timer_poll_timeout(void)
+{
+	if (timer_heap_len == 0)
+		return -1;
+
+	uint64_t now = now_ns();
+
+	if (timer_heap[0]->deadline <= now)
+		return 0;
+
+	uint64_t ms = (timer_heap[0]->deadline - now + NS_PER_MS - 1) / NS_PER_MS;
+
+	return ms > INT_MAX ? INT_MAX : (int) ms;
+}
+
+static void timer_run_expired(void)
+{
+	uint64_t now = now_ns();
+
+	while (timer_heap_len > 0 && timer_heap[0]->deadline <= now) {
+		struct timer * t = timer_heap[0];
+
+		timer_cancel(t);
+		t->fn(t);
+	}
+}
+
+
+/*
+ * worker threads
+ *
+ * work done inside the filemon process (plugins) runs on a pool of worker threads.
+ * monitor() submits work items; once fn has returned on a worker thread, the item is moved
+ * to the completed list and work_done_fd (an eventfd) becomes readable: monitor() then calls
+ * done, so filemon data structures are only changed by the thread of monitor().
+ */
+
+struct work {
+	struct work * next;
+	void (*fn)(struct work * w);    // executed by a worker thread
+	void (*done)(struct work * w);  // executed by monitor() after fn
+};
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+// protected by work_lock
+static struct work * work_head = NULL;          // submitted
+static struct work * work_tail = NULL;
+static struct work * work_done_head = NULL;     // completed, waiting for done
+static struct work * work_done_tail = NULL;
+static bool work_stop = false;
+
+static pthread_t * worker_threads = NULL;
+static int workers_started = 0;
+
+static int work_done_fd = -1;
+
+// submitted and not yet done; used by monitor() only
+static int work_pending = 0;
+
+static void * worker_main(void * arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&work_lock);
+
+	for (;;) {
+		while (work_head == NULL && !work_stop)
+			pthread_cond_wait(&work_cond, &work_lock);
+
+		// submitted work is completed before the workers stop
+		if (work_head == NULL)
+			break;
+
+		struct work * w = work_head;
+
+		work_head = w->next;
+		if (work_head == NULL)
+			work_tail = NULL;
+
+		pthread_mutex_unlock(&work_lock);
+
+		w->fn(w);
+
+		pthread_mutex_lock(&work_lock);
+
+		w->next = NULL;
+		if (work_done_tail != NULL)
+			work_done_tail->next = w;
+		else
+			work_done_head = w;
+		work_done_tail = w;
+
+		uint64_t one = 1;
+
+		if (write(work_done_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			syslog(LOG_ERR, "[worker] write to eventfd: %s", strerror(errno));
+	}
+
+	pthread_mutex_unlock(&work_lock);
+
+	return NULL;
+}
+
+// blocks SIGTERM and SIGINT in the calling thread, and so in the threads it creates: they are
+// left to the thread of monitor(), whose poll() they interrupt; *old receives the previous mask
+static void signals_block(sigset_t * old)
+{
+	sigset_t blocked;
+
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &blocked, old);
+}
+
+// starts the worker threads, on the CPUs of handlers (see reader_cpu)
+static void workers_start(void)
+{
+	pthread_attr_t attr;
+
+	work_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	worker_threads = calloc(workers, sizeof(pthread_t));
+	if (work_done_fd == -1 || worker_threads == NULL) {
+		syslog(LOG_ERR, "cannot create worker threads");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_attr_init(&attr);
+
+	if (reader_cpu >= 0)
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &handler_cpus);
+
+	sigset_t old;
+
+	signals_block(&old);
+
+	for (int i = 0; i < workers; i++) {
+		int res = pthread_create(&worker_threads[i], &attr, worker_main, NULL);
+
+		if (res != 0) {
+			syslog(LOG_ERR, "pthread_create: %s", strerror(res));
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_setname_np(worker_threads[i], "filemon-worker");
+		workers_started++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	syslog(LOG_INFO, "%d worker threads", workers);
+}
+
+static void work_submit(struct work * w)
+{
+	w->next = NULL;
+	work_pending++;
+
+	pthread_mutex_lock(&work_lock);
+
+	if (work_tail != NULL)
+		work_tail->next = w;
+	else
+		work_head = w;
+	work_tail = w;
+
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+// work_done_fd is readable: calls done for the completed work items
+static void work_complete(void)
+{
+	uint64_t count;
+
+	if (read(work_done_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "read from eventfd: %s", strerror(errno));
+
+	pthread_mutex_lock(&work_lock);
+	struct work * w = work_done_head;
+	work_done_head = work_done_tail = NULL;
+	pthread_mutex_unlock(&work_lock);
+
+	while (w != NULL) {
+		struct work * next = w->next;
+
+		work_pending--;
+		w->done(w);
+		w = next;
+	}
+}
+
+// waits for the submitted work to be completed, including the work submitted by done functions,
+// then stops the worker threads
+static void workers_stop(void)
+{
+	while (work_pending > 0) {
+		struct pollfd pfd = { .fd = work_done_fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			break;
+
+		work_complete();
+	}
+
+	pthread_mutex_lock(&work_lock);
+	work_stop = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+
+	for (int i = 0; i < workers_started; i++)
+		pthread_join(worker_threads[i], NULL);
+
+	if (workers_started > 0)
+		work_complete();
+
+	workers_started = 0;
+}
+
+
+/*
+ * resource usage of handlers, as returned by wait4(); aggregated per rule and per watched directory
+ */
+
+#define USAGE_BUCKETS 24
+
+struct usage {
+	uint64_t jobs;
+	uint64_t utime_us;
+	uint64_t stime_us;
+	uint64_t inblock;           // block input operations
+	uint64_t oublock;           // block output operations
+	uint64_t nvcsw;             // voluntary context switches
+	uint64_t nivcsw;            // involuntary context switches
+	long maxrss_kb;             // largest maximum resident set size of a handler
+	uint64_t cpu_hist[USAGE_BUCKETS];   // jobs by user + system CPU time, bucket k: up to 1 ms << k
+	uint64_t rss_hist[USAGE_BUCKETS];   // jobs by maximum resident set size, bucket k: up to 256 KB << k
+};
+
+static int usage_bucket(uint64_t value, uint64_t first_bound)
+{
+	int k = 0;
+
+	while (k < USAGE_BUCKETS - 1 && value > first_bound << k)
+		k++;
+
+	return k;
+}
+
+static void usage_add(struct usage * u, const struct rusage * ru)
+{
+	uint64_t utime_us = (uint64_t) ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+	uint64_t stime_us = (uint64_t) ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+
+	u->jobs++;
+	u->utime_us += utime_us;
+	u->stime_us += stime_us;
+	u->inblock += ru->ru_inblock;
+	u->oublock += ru->ru_oublock;
+	u->nvcsw += ru->ru_nvcsw;
+	u->nivcsw += ru->ru_nivcsw;
+
+	if (ru->ru_maxrss > u->maxrss_kb)
+		u->maxrss_kb = ru->ru_maxrss;
+
+	u->cpu_hist[usage_bucket(utime_us + stime_us, 1000)]++;
+	u->rss_hist[usage_bucket(ru->ru_maxrss, 256)]++;
+}
+
+// label is the Prometheus label which identifies u, e.g. rule="default"
+static void write_usage_metrics(FILE * f, const char * label, const struct usage * u)
+{
+	uint64_t cumulative;
+
+	if (u->jobs == 0)
+		return;
+
+	fprintf(f, "filemon_usage_jobs_total{%s} %llu\n", label, (unsigned long long) u->jobs);
+	fprintf(f, "filemon_usage_cpu_user_seconds_total{%s} %.6f\n", label, u->utime_us / 1e6);
+	fprintf(f, "filemon_usage_cpu_system_seconds_total{%s} %.6f\n", label, u->stime_us / 1e6);
+	fprintf(f, "filemon_usage_block_input_ops_total{%s} %llu\n", label, (unsigned long long) u->inblock);
+	fprintf(f, "filemon_usage_block_output_ops_total{%s} %llu\n", label, (unsigned long long) u->oublock);
+	fprintf(f, "filemon_usage_voluntary_context_switches_total{%s} %llu\n", label, (unsigned long long) u->nvcsw);
+	fprintf(f, "filemon_usage_involuntary_context_switches_total{%s} %llu\n", label, (unsigned long long) u->nivcsw);
+	fprintf(f, "filemon_usage_max_rss_bytes{%s} %llu\n", label, (unsigned long long) u->maxrss_kb * 1024);
+
+	cumulative = 0;
+	for (int k = 0; k < USAGE_BUCKETS - 1; k++) {
+		cumulative += u->cpu_hist[k];
+		fprintf(f, "filemon_usage_job_cpu_seconds_bucket{%s,le=\"%g\"} %llu\n", label,
+				(double) (1000ULL << k) / 1e6, (unsigned long long) cumulative);
+	}
+	fprintf(f, "filemon_usage_job_cpu_seconds_bucket{%s,le=\"+Inf\"} %llu\n", label, (unsigned long long) u->jobs);
+	fprintf(f, "filemon_usage_job_cpu_seconds_sum{%s} %.6f\n", label, (u->utime_us + u->stime_us) / 1e6);
+	fprintf(f, "filemon_usage_job_cpu_seconds_count{%s} %llu\n", label, (unsigned long long) u->jobs);
+
+	cumulative = 0;
+	for (int k = 0; k < USAGE_BUCKETS - 1; k++) {
+		cumulative += u->rss_hist[k];
+		fprintf(f, "filemon_usage_job_max_rss_bytes_bucket{%s,le=\"%llu\"} %llu\n", label,
+				(256ULL << k) * 1024, (unsigned long long) cumulative);
+	}
+	fprintf(f, "filemon_usage_job_max_rss_bytes_bucket{%s,le=\"+Inf\"} %llu\n", label, (unsigned long long) u->jobs);
+	fprintf(f, "filemon_usage_job_max_rss_bytes_count{%s} %llu\n", label, (unsigned long long) u->jobs);
+}
+
+
+/*
+ * rules
+ *
+ * a rule tells what to do with a file: the command to execute and how to run it.
+ * rule settings are listed in rule_options[], each one is also a command line option
+ * which applies to the default rule.
+ */
+
+struct job;
+
+// moves, links or deletes the file when its job is over
+struct disposition {
+	int mode;                   // DISPOSE_KEEP, DISPOSE_MOVE, DISPOSE_LINK, DISPOSE_DELETE
+	char * dir;                 // destination of DISPOSE_MOVE and DISPOSE_LINK
+	int fd;                     // descriptor of dir, -1 if not set
+};
+
+// rename_commit: size of the table of the waiting jobs of a rule, see rename_job_add()
+#define RENAME_JOBS_BUCKETS 1024
+
+struct rule {
+	const char * name;
+	char * command;             // command to execute on file (-c)
+
+	// which events the rule takes, see rule_match()
+	char * under;               // files in this directory or below it, NULL = all watched directories
+	char * glob;                // file name pattern, fnmatch() syntax
+	char * suffix;              // file name suffix
+	char * regex;               // file name pattern, POSIX extended regular expression
+	uint32_t events;            // inotify events which create jobs (default: IN_CLOSE_WRITE)
+	int64_t min_size;           // only files of at least min_size bytes
+	int64_t max_size;           // only files of at most max_size bytes, 0 = no limit
+	uint32_t content_types;     // only files of these types, bit (1 << CONTENT_...) for each type, 0 = any
+	int match_kind;             // MATCH_ANY, MATCH_EXACT, ...: how the name is matched
+	const char * literal;       // MATCH_EXACT, MATCH_PREFIX, MATCH_SUFFIX: the literal part of the pattern
+	size_t literal_len;
+	regex_t regex_comp;         // compiled regex
+	uint64_t events_matched;    // events taken by the rule
+
+	long timeout_ms;            // handler wall clock limit, 0 = no limit
+	long kill_grace_ms;         // time between SIGTERM and SIGKILL when timeout_ms expires
+	int retries;                // failed jobs are executed again up to this number of times
+	long retry_delay_ms;        // delay before the first retry, doubled at every retry
+	long retry_max_delay_ms;    // upper bound of the retry delay
+	struct disposition done;    // what happens to the file after the job has succeeded
+	struct disposition dead_letter;     // what happens to the file after the job has failed for good
+	bool durable;               // dispositions are made durable with fsync() of the directories
+	bool evict;                 // the file is dropped from the page cache when its job has succeeded
+	int breaker_threshold;      // percentage of failed jobs which opens the circuit breaker, 0 = no breaker
+	int breaker_window;         // number of most recent jobs the failure percentage is computed on
+	long breaker_cooldown_ms;   // time the breaker stays open before a probe job is let through
+	bool pass_fd;               // the handler receives the file already open as HANDLER_FD
+	int stdin_mode;             // STDIN_NONE, STDIN_FILE, STDIN_PIPE: content of the file on stdin of the handler
+	bool rename_commit;         // files are written with a temporary name and renamed: IN_MOVED_TO completes them
+	char * temp_glob;           // rename_commit: temporary names, NULL = hidden names and temp_patterns
+	char * group_marker;        // files wait until a file whose name matches this pattern arrives, NULL = no groups
+	int group_by;               // GROUP_BY_DIR, GROUP_BY_STEM: which waiting files a marker completes
+	long group_timeout_ms;      // files which have waited this time are processed without marker, 0 = never
+	long settle_ms;             // jobs wait until size and mtime of the file have not changed for this time, 0 = no wait
+	bool tail;                  // files are followed while they grow: handlers get the appended bytes on stdin
+	long tail_delay_ms;         // tail: bytes appended within this time are passed to a single handler
+	char * output_log;          // stdout and stderr of handlers are appended to this file
+	int64_t output_log_size;    // output_log is rotated when it grows over this size
+	int output_log_keep;        // number of rotated output_log files which are kept
+	bool has_cpus;              // handlers run on cpus only
+	cpu_set_t cpus;
+	int nice;                   // nice value of handlers, NICE_UNSET to inherit the one of filemon
+	int ioprio;                 // I/O priority of handlers, ioprio_set() format, -1 to inherit
+	bool sched_idle;            // handlers run with the SCHED_IDLE policy
+	char * plugin;              // shared object which processes the files instead of command
+	char * plugin_args;         // passed to the init function of plugin
+	int batch_size;             // maximum number of files passed to plugin in a single call
+	int action;                 // ACTION_COMMAND, or a built-in action executed by worker threads
+	char * copy_to;             // copy action: destination directory
+	int copy_to_fd;             // O_PATH descriptor of copy_to, -1 if not set
+	int checksum;               // CHECKSUM_NONE, or the checksum computed before the action
+	char * checksum_dir;        // sidecar files NAME.ALGORITHM are written to this directory
+	int checksum_dir_fd;        // O_PATH descriptor of checksum_dir, -1 if not set
+
+	// plugin
+	void * plugin_handle;       // returned by dlopen()
+	const struct filemon_plugin * plugin_ops;   // NULL if the rule executes command
+	void * plugin_state;        // returned by plugin_ops->init()
+
+	// handler output
+	int output_fd;              // output_log, -1 if not set
+	int64_t output_offset;      // size of output_log
+	struct job * output_writer; // job whose output has been written last to output_log
+
+	// circuit breaker
+	int breaker_state;          // BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN
+	uint64_t breaker_outcomes;  // most recent job outcomes, bit 0 is the last one, 1 = failed
+	int breaker_samples;        // valid bits in breaker_outcomes, up to breaker_window
+	bool breaker_probing;       // half open: the probe job is running
+	struct timer breaker_timer; // open -> half open
+
+	// jobs waiting for a free handler slot
+	struct job * queue_head;
+	struct job * queue_tail;
+	int queued;
+	struct job * prefetch_last; // last queued job looked at by prefetch_jobs(), NULL = none
+
+	uint64_t jobs_succeeded;
+	uint64_t jobs_failed;
+	uint64_t jobs_timed_out;    // handlers which received SIGTERM because of timeout_ms
+	uint64_t jobs_killed;       // handlers which received SIGKILL after kill_grace_ms
+	uint64_t jobs_retried;
+	uint64_t jobs_dead_lettered;
+	uint64_t files_done;        // files moved, linked or deleted after their job has succeeded
+	uint64_t breaker_opened;    // closed or half open -> open transitions
+	uint64_t output_bytes;      // bytes written to output_log
+	uint64_t stdin_bytes;       // bytes moved to the stdin pipes of handlers (STDIN_PIPE)
+	uint64_t evicted_bytes;     // evict: bytes dropped from the page cache
+	uint64_t evict_writebacks;  // evict: files with dirty pages, written back before they were dropped
+	uint64_t temp_closes;       // rename_commit: IN_CLOSE_WRITE of temporary names, not processed
+	uint64_t renames_retargeted;    // rename_commit: renamed files whose queued job has taken the new name
+	uint64_t renames_skipped;   // rename_commit: files renamed after they have been processed, not processed again
+	uint64_t renames_rerouted;  // rename_commit: waiting files renamed to a name of another rule
+	struct job ** rename_jobs;  // rename_commit: RENAME_JOBS_BUCKETS chains of the waiting jobs, by file name
+	struct job * group_head;    // group: files waiting for their marker, oldest first
+	int group_waiting;
+	struct timer group_timer;   // group: group_timeout_ms after the arrival of the oldest waiting file
+	uint64_t groups;            // group: jobs started for groups of files
+	int tail_files;             // tail: files followed
+	uint64_t tail_truncations;  // tail: files which have shrunk below the offset already delivered
+	uint64_t tail_rotations;    // tail: files renamed or removed while followed
+	uint64_t batches;           // handle_batch() calls of plugin
+	uint64_t copy_bytes;        // copy action: bytes copied; updated by worker threads
+	uint64_t copy_reflinks;     // copy action: files cloned with FICLONE; updated by worker threads
+	uint64_t checksum_bytes;    // bytes read to compute checksums; updated by worker threads
+	struct usage usage;         // resources used by the handlers of the rule
+};
+
+enum { DISPOSE_KEEP, DISPOSE_MOVE, DISPOSE_LINK, DISPOSE_DELETE };
+
+enum { ACTION_COMMAND, ACTION_COPY, ACTION_CHECKSUM };
+
+enum { STDIN_NONE, STDIN_FILE, STDIN_PIPE };
+
+enum { GROUP_BY_DIR, GROUP_BY_STEM };
+
+enum {
+	CONTENT_EMPTY, CONTENT_TEXT, CONTENT_CSV, CONTENT_JSON, CONTENT_XML, CONTENT_GZIP, CONTENT_ZSTD, CONTENT_BZIP2,
+	CONTENT_XZ, CONTENT_ZIP, CONTENT_PARQUET, CONTENT_PDF, CONTENT_JPEG, CONTENT_PNG, CONTENT_GIF, CONTENT_ELF,
+	CONTENT_BINARY, CONTENT_TYPES
+};
+
+enum { MATCH_ANY, MATCH_EXACT, MATCH_PREFIX, MATCH_SUFFIX, MATCH_GLOB, MATCH_REGEX };
+
+enum { CHECKSUM_NONE, CHECKSUM_CRC32C, CHECKSUM_XXH64, CHECKSUM_SHA256 };
+
+enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+static const char * const breaker_states[] = { "closed", "open", "half_open" };
+
+#define BREAKER_MAX_WINDOW 64
+
+#define NICE_UNSET INT_MIN
+
+// see ioprio_set(2); linux/ioprio.h is not available with older kernel headers
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+enum { IOPRIO_CLASS_NONE, IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE };
+
+static struct rule ** rules = NULL;
+static int rules_len = 0;
+
+// rule built from command line options
+static struct rule * default_rule = NULL;
+
+static struct rule * rule_new(const char * name)
+{
+	struct rule * r = calloc(1, sizeof(struct rule));
+
+	rules = realloc(rules, sizeof(struct rule *) * (rules_len + 1));
+	if (r == NULL || rules == NULL) {
+		syslog(LOG_ERR, "cannot allocate rule");
+		exit(EXIT_FAILURE);
+	}
+
+	r->name = name;
+	r->kill_grace_ms = 5000;
+	r->retry_delay_ms = 1000;
+	r->retry_max_delay_ms = 60000;
+	r->done.fd = -1;
+	r->dead_letter.fd = -1;
+	r->breaker_window = 20;
+	r->breaker_cooldown_ms = 30000;
+	r->breaker_timer.heap_pos = -1;
+	r->group_timer.heap_pos = -1;
+	r->output_log_size = 64 << 20;
+	r->output_log_keep = 3;
+	r->output_fd = -1;
+	r->nice = NICE_UNSET;
+	r->ioprio = -1;
+	r->batch_size = 64;
+	r->copy_to_fd = -1;
+	r->checksum_dir_fd = -1;
+	r->tail_delay_ms = 200;
+	r->events = IN_CLOSE_WRITE;
+
+	rules[rules_len++] = r;
+
+	return r;
+}
+
+enum rule_option_type {
+	RULE_OPT_STRING,
+	RULE_OPT_MS,                // milliseconds, long
+	RULE_OPT_INT,               // int >= 0
+	RULE_OPT_KEYWORD,           // one of keywords[], stored as its index (int)
+	RULE_OPT_BOOL,              // yes/no, true/false, 1/0
+	RULE_OPT_SIZE,              // bytes, int64_t, with optional K, M, G suffix
+	RULE_OPT_CPUS,              // list of CPUs, e.g. 0-3,6, stored as cpu_set_t; sets has_cpus
+	RULE_OPT_NICE,              // int, -20..19
+	RULE_OPT_IOPRIO,            // idle, be:N or rt:N, stored in ioprio_set() format (int)
+	RULE_OPT_EVENTS,            // list of event names, e.g. close_write,moved_to, stored as inotify mask (uint32_t)
+	RULE_OPT_KEYWORDS,          // list of keywords[], stored as a bitmask of their indexes (uint32_t)
+};
+
+struct rule_option {
+	const char * key;
+	enum rule_option_type type;
+	size_t offset;              // offset of the setting in struct rule
+	const char * arg;           // argument name in help
+	const char * help;
+	const char * const * keywords;  // RULE_OPT_KEYWORD, RULE_OPT_KEYWORDS: NULL terminated list
+};
+
+static const char * const dispositions[] = { "keep", "move", "link", "delete", NULL };
+
+static const char * const stdin_modes[] = { "none", "file", "pipe", NULL };
+
+static const char * const group_bys[] = { "dir", "stem", NULL };
+
+static const char * const actions[] = { "command", "copy", "checksum", NULL };
+
+static const char * const content_types[] = {
+		"empty", "text", "csv", "json", "xml", "gzip", "zstd", "bzip2", "xz", "zip", "parquet", "pdf", "jpeg", "png",
+		"gif", "elf", "binary", NULL };
+
+static const char * const checksums[] = { "none", "crc32c", "xxh64", "sha256", NULL };
+
+static const struct {
+	const char * name;
+	uint32_t mask;
+} event_names[] = {
+		{ "close_write",   IN_CLOSE_WRITE },
+		{ "close_nowrite", IN_CLOSE_NOWRITE },
+		{ "create",        IN_CREATE },
+		{ "modify",        IN_MODIFY },
+		{ "attrib",        IN_ATTRIB },
+		{ "moved_to",      IN_MOVED_TO },
+		{ "moved_from",    IN_MOVED_FROM },
+		{ "delete",        IN_DELETE },
+};
+
+static const struct rule_option rule_options[] = {
+		{ "under",      RULE_OPT_STRING, offsetof(struct rule, under), "DIR",
+				"take only files in DIR or below it (default: all watched directories)", NULL },
+		{ "glob",       RULE_OPT_STRING, offsetof(struct rule, glob), "PATTERN",
+				"take only files whose name matches PATTERN, e.g. *.jpg", NULL },
+		{ "suffix",     RULE_OPT_STRING, offsetof(struct rule, suffix), "SUFFIX",
+				"take only files whose name ends with SUFFIX", NULL },
+		{ "regex",      RULE_OPT_STRING, offsetof(struct rule, regex), "REGEX",
+				"take only files whose name matches the extended regular expression REGEX", NULL },
+		{ "events",     RULE_OPT_EVENTS, offsetof(struct rule, events), "LIST",
+				"events which start the command: close_write, moved_to, create, ... (default: close_write)", NULL },
+		{ "content-type", RULE_OPT_KEYWORDS, offsetof(struct rule, content_types), "LIST",
+				"take only files whose content is of one of these types: gzip, zstd, parquet, pdf, jpeg, csv, json, text, ...",
+				content_types },
+		{ "min-size",   RULE_OPT_SIZE, offsetof(struct rule, min_size), "BYTES",
+				"take only files of at least BYTES", NULL },
+		{ "max-size",   RULE_OPT_SIZE, offsetof(struct rule, max_size), "BYTES",
+				"take only files of at most BYTES", NULL },
+		{ "timeout",    RULE_OPT_MS, offsetof(struct rule, timeout_ms), "MS",
+				"send SIGTERM to commands running longer than MS (default: no limit)", NULL },
+		{ "kill-grace", RULE_OPT_MS, offsetof(struct rule, kill_grace_ms), "MS",
+				"send SIGKILL MS after SIGTERM (default: 5000)", NULL },
+		{ "retries",    RULE_OPT_INT, offsetof(struct rule, retries), "N",
+				"execute a failed command again up to N times (default: 0)", NULL },
+		{ "retry-delay", RULE_OPT_MS, offsetof(struct rule, retry_delay_ms), "MS",
+				"delay before the first retry, doubled at every retry (default: 1000)", NULL },
+		{ "retry-max-delay", RULE_OPT_MS, offsetof(struct rule, retry_max_delay_ms), "MS",
+				"upper bound of the retry delay (default: 60000)", NULL },
+		{ "dead-letter", RULE_OPT_STRING, offsetof(struct rule, dead_letter.dir), "DIR",
+				"move files whose command has failed for good to DIR", NULL },
+		{ "dead-letter-mode", RULE_OPT_KEYWORD, offsetof(struct rule, dead_letter.mode), "move|link|delete",
+				"move the file to the dead letter directory, create a hard link, or delete the file (default: move)",
+				dispositions },
+		{ "done-dir", RULE_OPT_STRING, offsetof(struct rule, done.dir), "DIR",
+				"move files whose command has succeeded to DIR", NULL },
+		{ "done-mode", RULE_OPT_KEYWORD, offsetof(struct rule, done.mode), "move|link|delete",
+				"move the file to the done directory, create a hard link, or delete the file (default: move)",
+				dispositions },
+		{ "durable", RULE_OPT_BOOL, offsetof(struct rule, durable), "yes|no",
+				"fsync() the directories changed by done and dead letter dispositions (default: no)", NULL },
+		{ "evict", RULE_OPT_BOOL, offsetof(struct rule, evict), "yes|no",
+				"drop the file from the page cache when its command has succeeded (default: no)", NULL },
+		{ "breaker-threshold", RULE_OPT_INT, offsetof(struct rule, breaker_threshold), "PCT",
+				"stop executing the command when PCT percent of the recent jobs have failed (default: 0, never)", NULL },
+		{ "breaker-window", RULE_OPT_INT, offsetof(struct rule, breaker_window), "N",
+				"number of recent jobs the failure percentage is computed on, up to 64 (default: 20)", NULL },
+		{ "breaker-cooldown", RULE_OPT_MS, offsetof(struct rule, breaker_cooldown_ms), "MS",
+				"after MS, let a probe job through to check if the command works again (default: 30000)", NULL },
+		{ "pass-fd", RULE_OPT_BOOL, offsetof(struct rule, pass_fd), "yes|no",
+				"open the file when the event is read and pass it to the command as fd 3 (default: no)", NULL },
+		{ "stdin", RULE_OPT_KEYWORD, offsetof(struct rule, stdin_mode), "none|file|pipe",
+				"connect stdin of commands to the file, or to a pipe which filemon fills with the file (default: none)",
+				stdin_modes },
+		{ "rename-commit", RULE_OPT_BOOL, offsetof(struct rule, rename_commit), "yes|no",
+				"files are written with a temporary name, then renamed: process them when they are renamed (default: no)", NULL },
+		{ "temp-glob", RULE_OPT_STRING, offsetof(struct rule, temp_glob), "PATTERN",
+				"rename-commit: temporary names (default: .* *.swp *.swx *.part *.tmp *~)", NULL },
+		{ "group-marker", RULE_OPT_STRING, offsetof(struct rule, group_marker), "PATTERN",
+				"hold files until a marker file matching PATTERN arrives, then run the command once with all of them", NULL },
+		{ "group-by", RULE_OPT_KEYWORD, offsetof(struct rule, group_by), "dir|stem",
+				"a marker completes the files of its directory, or the files named as the marker without extension (default: dir)",
+				group_bys },
+		{ "group-timeout", RULE_OPT_MS, offsetof(struct rule, group_timeout_ms), "MS",
+				"run the command on files which have waited MS for a marker (default: 0, wait for ever)", NULL },
+		{ "settle", RULE_OPT_MS, offsetof(struct rule, settle_ms), "MS",
+				"process a file only when its size and mtime have not changed for MS (default: 0, at once)", NULL },
+		{ "tail", RULE_OPT_BOOL, offsetof(struct rule, tail), "yes|no",
+				"follow files while they grow, and pass the appended bytes to commands on stdin (default: no)", NULL },
+		{ "tail-delay", RULE_OPT_MS, offsetof(struct rule, tail_delay_ms), "MS",
+				"tail: pass the bytes appended within MS to a single command (default: 200)", NULL },
+		{ "output-log", RULE_OPT_STRING, offsetof(struct rule, output_log), "PATH",
+				"append stdout and stderr of commands to PATH (default: stdout and stderr of filemon)", NULL },
+		{ "output-log-size", RULE_OPT_SIZE, offsetof(struct rule, output_log_size), "BYTES",
+				"rotate the output log when it grows over BYTES (default: 64M)", NULL },
+		{ "output-log-keep", RULE_OPT_INT, offsetof(struct rule, output_log_keep), "N",
+				"number of rotated output logs which are kept (default: 3)", NULL },
+		{ "cpus", RULE_OPT_CPUS, offsetof(struct rule, cpus), "LIST",
+				"run commands only on the CPUs in LIST, e.g. 2-7,10", NULL },
+		{ "nice", RULE_OPT_NICE, offsetof(struct rule, nice), "N",
+				"run commands with nice value N", NULL },
+		{ "ioprio", RULE_OPT_IOPRIO, offsetof(struct rule, ioprio), "CLASS",
+				"run commands with I/O priority idle, be:0..7 or rt:0..7", NULL },
+		{ "sched-idle", RULE_OPT_BOOL, offsetof(struct rule, sched_idle), "yes|no",
+				"run commands with the SCHED_IDLE scheduling policy (default: no)", NULL },
+		{ "plugin", RULE_OPT_STRING, offsetof(struct rule, plugin), "PATH",
+				"process files with the plugin PATH (shared object) instead of -c command", NULL },
+		{ "plugin-args", RULE_OPT_STRING, offsetof(struct rule, plugin_args), "ARGS",
+				"string passed to the init function of the plugin", NULL },
+		{ "batch-size", RULE_OPT_INT, offsetof(struct rule, batch_size), "N",
+				"pass up to N files to each call of the plugin (default: 64)", NULL },
+		{ "action", RULE_OPT_KEYWORD, offsetof(struct rule, action), "command|copy|checksum",
+				"execute -c command, copy the file to --copy-to DIR, or only compute its checksum (default: command)",
+				actions },
+		{ "copy-to", RULE_OPT_STRING, offsetof(struct rule, copy_to), "DIR",
+				"copy action: destination directory", NULL },
+		{ "checksum", RULE_OPT_KEYWORD, offsetof(struct rule, checksum), "ALG",
+				"compute the checksum of the file before the action: none, crc32c, xxh64, sha256 (default: none)",
+				checksums },
+		{ "checksum-dir", RULE_OPT_STRING, offsetof(struct rule, checksum_dir), "DIR",
+				"write the checksum of each file to DIR/NAME.ALG", NULL },
+};
+
+#define RULE_OPTIONS (sizeof(rule_options) / sizeof(rule_options[0]))
+
+// parses a number of bytes with optional K, M, G suffix; returns -1 if it is not valid
+static int parse_size(const char * value, int64_t * size)
+{
+	char * end;
+
+	errno = 0;
+	long long n = strtoll(value, &end, 10);
+	if (errno != 0 || end == value || n < 0)
+		return -1;
+
+	int shift;
+
+	switch (*end) {
+	case 'G': case 'g': shift = 30; end++; break;
+	case 'M': case 'm': shift = 20; end++; break;
+	case 'K': case 'k': shift = 10; end++; break;
+	case 0: shift = 0; break;
+	default:
+		return -1;
+	}
+	if (*end != 0)
+		return -1;
+
+	// the size would not fit in int64_t
+	if (n > (INT64_MAX >> shift))
+		return -1;
+
+	*size = (int64_t) n << shift;
+
+	return 0;
+}
+
+// parses a list of CPUs like 0-3,6; returns -1 if the list is not valid
+static int parse_cpu_list(const char * list, cpu_set_t * set)
+{
+	const char * p = list;
+
+	CPU_ZERO(set);
+
+	while (*p != 0) {
+		char * end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+
+		if (end == p || first < 0)
+			return -1;
+
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -1;
+
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+
+		if (*end == ',')
+			end++;
+		else if (*end != 0)
+			return -1;
+
+		p = end;
+	}
+
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// returns 0 if value is valid for option o, -1 otherwise
+static int set_rule_option(struct rule * r, const struct rule_option * o, char * value)
+{
+	void * field = (char *) r + o->offset;
+	char * end;
+
+	switch (o->type) {
+	case RULE_OPT_STRING:
+		*(char **) field = value;
+		break;
+	case RULE_OPT_MS:
+		errno = 0;
+		*(long *) field = strtol(value, &end, 10);
+		if (errno != 0 || end == value || *end != 0 || *(long *) field < 0)
+			goto invalid;
+		break;
+	case RULE_OPT_INT:
+		errno = 0;
+		long l = strtol(value, &end, 10);
+		if (errno != 0 || end == value || *end != 0 || l < 0 || l > INT_MAX)
+			goto invalid;
+		*(int *) field = l;
+		break;
+	case RULE_OPT_KEYWORD:
+		for (int k = 0; o->keywords[k] != NULL; k++) {
+			if (strcmp(value, o->keywords[k]) == 0) {
+				*(int *) field = k;
+				return 0;
+			}
+		}
+		goto invalid;
+	case RULE_OPT_BOOL:
+		if (strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+			*(bool *) field = true;
+		else if (strcmp(value, "no") == 0 || strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+			*(bool *) field = false;
+		else
+			goto invalid;
+		break;
+	case RULE_OPT_SIZE:
+		if (parse_size(value, (int64_t *) field) == -1)
+			goto invalid;
+		break;
+	case RULE_OPT_CPUS:
+		if (parse_cpu_list(value, (cpu_set_t *) field) == -1)
+			goto invalid;
+		r->has_cpus = true;
+		break;
+	case RULE_OPT_NICE:
+		errno = 0;
+		long niceness = strtol(value, &end, 10);
+		if (errno != 0 || end == value || *end != 0 || niceness < -20 || niceness > 19)
+			goto invalid;
+		*(int *) field = niceness;
+		break;
+	case RULE_OPT_IOPRIO:
+		if (strcmp(value, "idle") == 0) {
+			*(int *) field = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+		} else if ((strncmp(value, "be:", 3) == 0 || strncmp(value, "rt:", 3) == 0)
+				&& value[3] >= '0' && value[3] <= '7' && value[4] == 0) {
+			*(int *) field = IOPRIO_PRIO_VALUE(value[0] == 'b' ? IOPRIO_CLASS_BE : IOPRIO_CLASS_RT, value[3] - '0');
+		} else {
+			goto invalid;
+		}
+		break;
+	case RULE_OPT_EVENTS:
+		*(uint32_t *) field = 0;
+
+		for (char * name = value, * next; name != NULL; name = next) {
+			size_t k;
+
+			next = strchr(name, ',');
+			size_t len = next != NULL ? (size_t) (next++ - name) : strlen(name);
+
+			for (k = 0; k < sizeof(event_names) / sizeof(event_names[0]); k++) {
+				if (strlen(event_names[k].name) == len && strncmp(name, event_names[k].name, len) == 0)
+					break;
+			}
+			if (k == sizeof(event_names) / sizeof(event_names[0]))
+				goto invalid;
+
+			*(uint32_t *) field |= event_names[k].mask;
+		}
+		break;
+	case RULE_OPT_KEYWORDS:
+		*(uint32_t *) field = 0;
+
+		for (char * name = value, * next; name != NULL; name = next) {
+			int k;
+
+			next = strchr(name, ',');
+			size_t len = next != NULL ? (size_t) (next++ - name) : strlen(name);
+
+			for (k = 0; o->keywords[k] != NULL; k++) {
+				if (strlen(o->keywords[k]) == len && strncmp(name, o->keywords[k], len) == 0)
+					break;
+			}
+			if (o->keywords[k] == NULL)
+				goto invalid;
+
+			*(uint32_t *) field |= 1u << k;
+		}
+		break;
+	}
+
+	return 0;
+
+invalid:
+	syslog(LOG_ERR, "rule %s: invalid value for %s: %s", r->name, o->key, value);
+	return -1;
+}
+
+// percentage of failed jobs among the last breaker_window jobs of rule r
+static int breaker_failure_percent(struct rule * r)
+{
+	if (r->breaker_samples == 0)
+		return 0;
+
+	return __builtin_popcountll(r->breaker_outcomes) * 100 / r->breaker_samples;
+}
+
+#define BATCH_MAX 1024
+
+// loads the plugin of rule r
+static void plugin_open(struct rule * r)
+{
+	int error = 0;
+
+	r->plugin_handle = dlopen(r->plugin, RTLD_NOW | RTLD_LOCAL);
+	if (r->plugin_handle == NULL) {
+		syslog(LOG_ERR, "rule %s: cannot load plugin: %s", r->name, dlerror());
+		exit(EXIT_FAILURE);
+	}
+
+	r->plugin_ops = dlsym(r->plugin_handle, FILEMON_PLUGIN_SYMBOL);
+	if (r->plugin_ops == NULL) {
+		syslog(LOG_ERR, "rule %s: %s is not a filemon plugin", r->name, r->plugin);
+		exit(EXIT_FAILURE);
+	}
+
+	if (r->plugin_ops->abi_version != FILEMON_PLUGIN_ABI_VERSION
+			|| r->plugin_ops->init == NULL || r->plugin_ops->handle_batch == NULL) {
+		syslog(LOG_ERR, "rule %s: plugin %s has ABI version %u, %u is required", r->name, r->plugin,
+				r->plugin_ops->abi_version, FILEMON_PLUGIN_ABI_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	r->plugin_state = r->plugin_ops->init(r->plugin_args, &error);
+	if (error != 0) {
+		syslog(LOG_ERR, "rule %s: plugin %s initialization failed (%d)", r->name, r->plugin_ops->name, error);
+		exit(EXIT_FAILURE);
+	}
+
+	syslog(LOG_INFO, "rule %s: plugin %s loaded", r->name, r->plugin_ops->name);
+}
+
+// a directory without mode means move; opened for reading, so that it can be fsync()ed
+static void disposition_open(struct rule * r, struct disposition * d, const char * what)
+{
+	if (d->dir != NULL && d->mode == DISPOSE_KEEP)
+		d->mode = DISPOSE_MOVE;
+
+	if ((d->mode == DISPOSE_MOVE || d->mode == DISPOSE_LINK) && d->dir == NULL) {
+		syslog(LOG_ERR, "rule %s: %s mode %s requires a directory", r->name, what, dispositions[d->mode]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (d->dir != NULL) {
+		d->fd = open(d->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (d->fd == -1) {
+			syslog(LOG_ERR, "rule %s: cannot open %s directory %s", r->name, what, d->dir);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// returns how glob g is matched: a literal, or a literal with a single * at one end, is compared
+// as a string (*literal and *literal_len), the other patterns with fnmatch()
+static int glob_kind(const char * g, const char ** literal, size_t * literal_len)
+{
+	size_t len = strlen(g);
+	size_t prefix_len = strcspn(g, "*?[\\");
+
+	if (prefix_len == len) {
+		*literal = g;
+		*literal_len = len;
+		return MATCH_EXACT;
+	}
+
+	if (strcmp(g, "*") == 0)
+		return MATCH_ANY;
+
+	if (g[0] == '*' && strcspn(g + 1, "*?[\\") == len - 1) {
+		*literal = g + 1;
+		*literal_len = len - 1;
+		return MATCH_SUFFIX;
+	}
+
+	if (prefix_len == len - 1 && g[len - 1] == '*') {
+		*literal = g;
+		*literal_len = len - 1;
+		return MATCH_PREFIX;
+	}
+
+	return MATCH_GLOB;
+}
+
+// chooses how rule_match() matches file names to rule r: literals are looked up in tries,
+// the other patterns are matched one by one
+static void rule_pattern_open(struct rule * r)
+{
+
+	if ((r->glob != NULL) + (r->suffix != NULL) + (r->regex != NULL) > 1) {
+		syslog(LOG_ERR, "rule %s: only one of glob, suffix and regex can be set", r->name);
+		exit(EXIT_FAILURE);
+	}
+
+	r->match_kind = MATCH_ANY;
+
+	if (r->suffix != NULL) {
+		r->match_kind = MATCH_SUFFIX;
+		r->literal = r->suffix;
+		r->literal_len = strlen(r->suffix);
+	} else if (r->regex != NULL) {
+		int res = regcomp(&r->regex_comp, r->regex, REG_EXTENDED | REG_NOSUB);
+
+		if (res != 0) {
+			char msg[256];
+
+			regerror(res, &r->regex_comp, msg, sizeof(msg));
+			syslog(LOG_ERR, "rule %s: invalid regex %s: %s", r->name, r->regex, msg);
+			exit(EXIT_FAILURE);
+		}
+
+		r->match_kind = MATCH_REGEX;
+	} else if (r->glob != NULL) {
+		r->match_kind = glob_kind(r->glob, &r->literal, &r->literal_len);
+	}
+
+	if (r->under != NULL) {
+		char * abs_under = malloc(PATH_MAX);
+
+		if (abs_under == NULL || realpath(r->under, abs_under) == NULL) {
+			syslog(LOG_ERR, "rule %s: invalid directory %s", r->name, r->under);
+			exit(EXIT_FAILURE);
+		}
+
+		r->under = abs_under;
+	}
+}
+
+static void output_log_open(struct rule * r);
+static void action_open(struct rule * r);
+static void checksum_open(struct rule * r);
+
+// checks the settings of rule r and opens the resources it needs
+static void rule_open(struct rule * r)
+{
+	if (r->command == NULL && r->plugin == NULL && r->action == ACTION_COMMAND) {
+		syslog(LOG_ERR, "rule %s: no command, plugin or action", r->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (r->command != NULL && strlen(r->command) > MAX_COMMAND_LEN) {
+		syslog(LOG_ERR, "rule %s: invalid command", r->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (r->breaker_threshold > 100 || r->breaker_window < 1 || r->breaker_window > BREAKER_MAX_WINDOW) {
+		syslog(LOG_ERR, "rule %s: invalid circuit breaker settings", r->name);
+		exit(EXIT_FAILURE);
+	}
+
+	rule_pattern_open(r);
+
+	disposition_open(r, &r->done, "done");
+	disposition_open(r, &r->dead_letter, "dead letter");
+
+	if (r->output_log != NULL)
+		output_log_open(r);
+
+	if (r->plugin != NULL || r->action != ACTION_COMMAND) {
+		if (r->batch_size < 1 || r->batch_size > BATCH_MAX) {
+			syslog(LOG_ERR, "rule %s: batch size must be between 1 and %d", r->name, BATCH_MAX);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (r->plugin != NULL && r->action != ACTION_COMMAND) {
+		syslog(LOG_ERR, "rule %s: a rule has either a plugin or an action", r->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (r->plugin != NULL)
+		plugin_open(r);
+	else if (r->action != ACTION_COMMAND)
+		action_open(r);
+
+	if (r->checksum != CHECKSUM_NONE)
+		checksum_open(r);
+
+	// closes of temporary names are ignored, renames complete files
+	if (r->rename_commit) {
+		r->events |= IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO;
+
+		r->rename_jobs = calloc(RENAME_JOBS_BUCKETS, sizeof(struct job *));
+		if (r->rename_jobs == NULL) {
+			syslog(LOG_ERR, "calloc error");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (r->group_marker != NULL && (r->plugin != NULL || r->action != ACTION_COMMAND
+			|| r->checksum != CHECKSUM_NONE || r->settle_ms > 0 || r->tail)) {
+		syslog(LOG_ERR, "rule %s: groups work only with commands, without checksum, settle and tail settings", r->name);
+		exit(EXIT_FAILURE);
+	}
+
+	// the file is never over: it cannot be moved, and has no checksum
+	if (r->tail) {
+		if (r->plugin != NULL || r->action != ACTION_COMMAND || r->checksum != CHECKSUM_NONE || r->settle_ms > 0
+				|| r->done.mode != DISPOSE_KEEP || r->dead_letter.mode != DISPOSE_KEEP || r->evict) {
+			syslog(LOG_ERR, "rule %s: tail works only with commands, without checksum, settle, done, dead letter and evict settings", r->name);
+			exit(EXIT_FAILURE);
+		}
+
+		r->stdin_mode = STDIN_PIPE;
+	}
+}
+
+/*
+ * event filters
+ *
+ * --include and --exclude patterns are matched against the name of each event as soon as it has
+ * been read, before it is logged, matched to rules or stat()ed: an excluded event costs a few
+ * string comparisons. an event passes if it matches an include pattern (or there are none) and
+ * no exclude pattern.
+ */
+
+struct name_filter {
+	const char * pattern;
+	int kind;                   // MATCH_EXACT, MATCH_PREFIX, MATCH_SUFFIX, MATCH_ANY or MATCH_GLOB
+	const char * literal;
+	size_t literal_len;
+	uint64_t hits;              // events which have matched the pattern
+};
+
+static struct name_filter * includes = NULL;
+static int includes_len = 0;
+static struct name_filter * excludes = NULL;
+static int excludes_len = 0;
+
+// names of temporary files of editors and downloads, excluded by --exclude-temp
+static const char * const temp_patterns[] = { "*.swp", "*.swx", "*.part", "*.tmp", "*~", ".#*", NULL };
+
+static void filter_add(struct name_filter ** filters, int * len, const char * pattern)
+{
+	*filters = realloc(*filters, sizeof(struct name_filter) * (*len + 1));
+	if (*filters == NULL) {
+		syslog(LOG_ERR, "cannot allocate filter");
+		exit(EXIT_FAILURE);
+	}
+
+	struct name_filter * f = &(*filters)[(*len)++];
+
+	memset(f, 0, sizeof(struct name_filter));
+	f->pattern = pattern;
+	f->kind = glob_kind(pattern, &f->literal, &f->literal_len);
+}
+
+// returns the first filter of filters[0] .. filters[len - 1] which matches name, NULL if none
+static inline struct name_filter * filter_match(struct name_filter * filters, int len, const char * name, size_t name_len)
+{
+	for (int i = 0; i < len; i++) {
+		struct name_filter * f = &filters[i];
+		bool matched;
+
+		switch (f->kind) {
+		case MATCH_EXACT:
+			matched = name_len == f->literal_len && memcmp(name, f->literal, name_len) == 0;
+			break;
+		case MATCH_PREFIX:
+			matched = name_len >= f->literal_len && memcmp(name, f->literal, f->literal_len) == 0;
+			break;
+		case MATCH_SUFFIX:
+			matched = name_len >= f->literal_len && memcmp(name + name_len - f->literal_len, f->literal, f->literal_len) == 0;
+			break;
+		case MATCH_ANY:
+			matched = true;
+			break;
+		default:
+			matched = fnmatch(f->pattern, name, 0) == 0;
+		}
+
+		if (matched)
+			return f;
+	}
+
+	return NULL;
+}
+
+// true if the event about name passes the filters
+static inline bool filter_pass(const char * name)
+{
+	size_t name_len = strlen(name);
+	struct name_filter * f;
+
+	if (includes_len > 0) {
+		f = filter_match(includes, includes_len, name, name_len);
+		if (f == NULL)
+			return false;
+		f->hits++;
+	}
+
+	f = filter_match(excludes, excludes_len, name, name_len);
+	if (f != NULL) {
+		f->hits++;
+		return false;
+	}
+
+	return true;
+}
+
+// removes white space at both ends of s
+static char * str_trim(char * s)
+{
+	char * end = s + strlen(s);
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+
+	*end = 0;
+
+	return s;
+}
+
+/*
+ * rules file
+ *
+ *   # comment
+ *   [images]
+ *   under = /data/in
+ *   suffix = .jpg
+ *   command = /usr/local/bin/thumbnail
+ *   timeout = 10000
+ *
+ * every section is a rule; its settings are the rule options (without --) and command.
+ * an event is taken by the first rule in the file which matches it; the rule built from
+ * the command line options, if it has a command, comes last.
+ */
+static void rules_load(const char * path)
+{
+	FILE * f = fopen(path, "r");
+	char * line = NULL;
+	size_t line_size = 0;
+	int line_no = 0;
+	struct rule * r = NULL;
+
+	if (f == NULL) {
+		syslog(LOG_ERR, "cannot open rules file %s: %s", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (getline(&line, &line_size, f) != -1) {
+		char * p = str_trim(line);
+		char * eq;
+		size_t k;
+
+		line_no++;
+
+		if (*p == 0 || *p == '#' || *p == ';')
+			continue;
+
+		if (*p == '[') {
+			size_t len = strlen(p);
+
+			if (len < 3 || p[len - 1] != ']')
+				goto invalid;
+
+			p[len - 1] = 0;
+
+			for (int i = 0; i < rules_len; i++) {
+				if (strcmp(rules[i]->name, p + 1) == 0) {
+					syslog(LOG_ERR, "%s:%d: duplicate rule %s", path, line_no, p + 1);
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			r = rule_new(strdup(p + 1));
+			continue;
+		}
+
+		eq = strchr(p, '=');
+		if (eq == NULL || r == NULL)
+			goto invalid;
+
+		*eq = 0;
+
+		char * key = str_trim(p);
+		char * value = strdup(str_trim(eq + 1));
+
+		if (value == NULL) {
+			syslog(LOG_ERR, "cannot allocate rule setting");
+			exit(EXIT_FAILURE);
+		}
+
+		if (strcmp(key, "command") == 0) {
+			r->command = value;
+			continue;
+		}
+
+		for (k = 0; k < RULE_OPTIONS; k++) {
+			if (strcmp(key, rule_options[k].key) == 0)
+				break;
+		}
+
+		if (k == RULE_OPTIONS) {
+			syslog(LOG_ERR, "%s:%d: unknown setting %s", path, line_no, key);
+			exit(EXIT_FAILURE);
+		}
+
+		if (set_rule_option(r, &rule_options[k], value) == -1)
+			exit(EXIT_FAILURE);
+	}
+
+	free(line);
+	fclose(f);
+
+	return;
+
+invalid:
+	syslog(LOG_ERR, "%s:%d: invalid line", path, line_no);
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * jobs
+ *
+ * every IN_CLOSE_WRITE event becomes a job; jobs wait in the queue of their rule until one of the
+ * concurrency_limit handler slots is free. handlers are reaped asynchronously from monitor(),
+ * through a pidfd.
+ */
+
+struct job {
+	struct job * next;          // link in job queue or free list
+	struct rule * rule;
+	int dir_pos;                // index of the watched directory which notified the event
+	uint32_t mask;              // inotify mask of the event
+	uint64_t enqueue_ns;        // when the event has been read from inotify fd, or when the job is retried
+	uint64_t event_ts_ns;       // when the event has been read from inotify fd, CLOCK_REALTIME
+	uint64_t start_ns;          // when the handler has been started
+	pid_t pid;                  // handler process, 0 when not running
+	int pidfd;                  // pidfd of handler process, -1 when not running
+	struct timer timer;         // rule timeout while running, retry delay while waiting for a retry
+	bool term_sent;             // SIGTERM has been sent because of timeout
+	bool probe;                 // job let through a half open circuit breaker
+	int attempt;                // 1 for the first execution, incremented at every retry
+	int fd;                     // the file, opened when the event has been read (rule pass_fd), or -1
+	int output_fd;              // read end of the pipe connected to stdout and stderr of the handler, or -1
+	int stdin_fd;               // write end of the pipe connected to stdin of the handler (STDIN_PIPE), or -1
+	int stdin_src;              // the file, read into stdin_fd
+	loff_t stdin_off;           // offset in stdin_src of the next byte to move to stdin_fd
+	loff_t stdin_start;         // offset of the first byte of stdin_src for the handler
+	loff_t stdin_end;           // stdin_fd is closed at this offset of stdin_src, -1 = at end of file
+	struct tail_file * tail;    // tail: the file whose bytes stdin_start .. stdin_end the job delivers
+	struct job * members;       // group: the other files of the group, linked by next
+	int group_size;             // group: number of files passed to the handler, 0 if the job is not a group
+	bool group_marker;          // group: the file of the job is the marker, not a file of the group
+	int content_type;           // CONTENT_..., -1 if the file has not been read by rule_match()
+	int64_t prefetch_len;       // bytes of the file read ahead while the job is queued
+	struct job * rename_next;   // rename_commit: next job in the chain of rule->rename_jobs
+	bool rename_waiting;        // rename_commit: the job is in rule->rename_jobs
+	bool renamed_away;          // rename_commit: the file has been renamed to a name of another rule, the job is dropped
+	uint64_t settle_size;       // settle: size and mtime of the file at the last check
+	uint64_t settle_mtime_ns;
+	uint64_t settle_change_ns;  // settle: when the file has last been seen changing
+	char checksum[80];          // "algorithm:hex digits", empty until computed (rule checksum)
+	char path[PATH_MAX];        // absolute path of the file
+};
+
+// tail: bytes before the offset of a file kept to recognize it when it is written again
+#define TAIL_MARK_LEN 64
+
+// a file followed by a tail rule
+struct tail_file {
+	struct tail_file * next;
+	struct rule * rule;
+	int dir_pos;                // index of the watched directory of the file
+	char name[NAME_MAX + 1];
+	int fd;                     // the file, open read only
+	dev_t dev;
+	ino_t ino;
+	off_t offset;               // bytes passed to jobs
+	char mark[TAIL_MARK_LEN];   // the last bytes before offset, see tail_check()
+	int mark_len;
+	struct job * job;           // job which delivers bytes of the file, NULL if none
+	struct timer timer;         // tail_delay_ms after the first IN_MODIFY whose bytes are not delivered
+	uint64_t event_ts_ns;       // when that IN_MODIFY has been read
+	bool detached;              // the name has been removed, or belongs to another file
+};
+
+static struct job * job_free_list = NULL;
+
+// watched files and directories, as passed to monitor()
+static char_p * watched_dirs = NULL;
+static int watched_dirs_len = 0;
+
+// O_PATH descriptors of the watched directories, -1 for watched files
+static int * dir_fds = NULL;
+
+// resources used by the handlers of the files of each watched directory
+static struct usage * dir_usage = NULL;
+
+// sum of the jobs waiting in the queues of all rules
+static int jobs_queued = 0;
+
+// jobs waiting for the checksum stage, before the queue of their rule
+static struct job * checksum_head = NULL;
+static struct job * checksum_tail = NULL;
+static int checksum_queued = 0;
+
+// failed jobs waiting for their retry delay to expire
+static int jobs_retry_pending = 0;
+
+// jobs waiting for their file to settle, before the checksum stage
+static struct job * settle_head = NULL;
+static int settle_len = 0;
+
+// rule which is looked at first for the next free handler slot
+static int dispatch_next_rule = 0;
+
+// handlers currently running, max_jobs slots
+static struct job ** running = NULL;
+static int jobs_running = 0;
+
+static struct {
+	uint64_t events;            // events read from inotify fd
+	uint64_t events_unmatched;  // events taken by no rule
+	uint64_t events_filtered;   // events dropped by --include and --exclude
+	uint64_t queue_overflows;   // IN_Q_OVERFLOW: events dropped by the kernel
+	uint64_t content_sniffed[CONTENT_TYPES];    // files read to guess their type, by type
+	uint64_t prefetch_files;    // files of queued jobs read ahead
+	uint64_t prefetch_bytes;    // bytes read ahead
+	uint64_t prefetch_cached_bytes;     // bytes read ahead which were already cached
+	uint64_t prefetch_resident_bytes;   // bytes read ahead which were cached when the handler started
+	uint64_t settle_checks;     // statx() of files waiting to settle
+	uint64_t settle_merged;     // events about files already waiting to settle
+	uint64_t jobs_queued;       // jobs created by IN_CLOSE_WRITE events
+	uint64_t jobs_started;      // handlers started
+	uint64_t jobs_succeeded;    // handlers terminated with exit status 0
+	uint64_t jobs_failed;       // handlers terminated with non-zero exit status or by a signal
+	uint64_t jobs_timed_out;    // handlers which received SIGTERM because of rule timeout
+	uint64_t jobs_killed;       // handlers which received SIGKILL because of rule timeout
+	uint64_t jobs_retried;      // failed jobs scheduled for another execution
+	uint64_t jobs_dead_lettered;    // files moved, linked or deleted after their job has failed for good
+	uint64_t files_done;        // files moved, linked or deleted after their job has succeeded
+	uint64_t dir_syncs;         // fsync() of directories for durable dispositions
+	uint64_t dir_sync_files;    // dispositions made durable by dir_syncs
+	uint64_t dir_sync_errors;
+	uint64_t jobs_vanished;     // files which could not be opened when their event has been read
+	uint64_t job_run_ns;        // sum of handler run times
+	uint64_t job_wait_ns;       // sum of time spent by jobs in queue
+	uint64_t job_spawn_ns;      // sum of time between the start of a job and the creation of its handler
+	uint64_t batches;           // batches of jobs processed by plugins
+} stats;
+
+
+static struct job * job_alloc(void)
+{
+	struct job * j = job_free_list;
+
+	if (j != NULL) {
+		job_free_list = j->next;
+	} else {
+		j = malloc(sizeof(struct job));
+		if (j == NULL) {
+			syslog(LOG_ERR, "cannot allocate job");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memset(j, 0, offsetof(struct job, path));
+	j->pidfd = -1;
+	j->content_type = -1;
+	j->timer.heap_pos = -1;
+	j->attempt = 1;
+	j->fd = -1;
+	j->output_fd = -1;
+	j->stdin_fd = -1;
+	j->stdin_src = -1;
+	j->stdin_end = -1;
+	j->path[0] = 0;
+
+	return j;
+}
+
+/*
+ * jobs of rename_commit rules are in rule->rename_jobs while they wait (for their file to
+ * settle, for their group, for the checksum stage, in the queue, for a retry), so that a rename
+ * of their file finds them; they leave it when a handler or a worker takes them.
+ */
+
+static struct job ** rename_jobs_bucket(struct rule * r, int dir_pos, const char * name)
+{
+	uint32_t h = 2166136261u ^ (uint32_t) dir_pos;     // FNV-1a
+
+	for (const char * c = name; *c != 0; c++)
+		h = (h ^ (unsigned char) *c) * 16777619u;
+
+	return &r->rename_jobs[h % RENAME_JOBS_BUCKETS];
+}
+
+static void rename_job_add(struct job * j)
+{
+	// a group has become a single job: its files are not renamed one by one
+	if (j->rule->rename_jobs == NULL || j->rename_waiting || j->group_size > 0)
+		return;
+
+	struct job ** b = rename_jobs_bucket(j->rule, j->dir_pos, strrchr(j->path, '/') + 1);
+
+	j->rename_next = *b;
+	*b = j;
+	j->rename_waiting = true;
+}
+
+static void rename_job_del(struct job * j)
+{
+	if (!j->rename_waiting)
+		return;
+
+	for (struct job ** p = rename_jobs_bucket(j->rule, j->dir_pos, strrchr(j->path, '/') + 1); *p != NULL; p = &(*p)->rename_next) {
+		if (*p == j) {
+			*p = j->rename_next;
+			break;
+		}
+	}
+
+	j->rename_waiting = false;
+}
+
+static void tail_job_done(struct job * j);
+
+static void job_free(struct job * j)
+{
+	rename_job_del(j);
+
+	if (j->fd != -1)
+		close(j->fd);
+
+	for (struct job * m = j->members, * next; m != NULL; m = next) {
+		next = m->next;
+		job_free(m);
+	}
+
+	if (j->tail != NULL)
+		tail_job_done(j);
+
+	j->next = job_free_list;
+	job_free_list = j;
+}
+
+static void job_enqueue(struct job * j)
+{
+	struct rule * r = j->rule;
+
+	rename_job_add(j);
+
+	j->next = NULL;
+
+	if (r->queue_tail != NULL)
+		r->queue_tail->next = j;
+	else
+		r->queue_head = j;
+
+	r->queue_tail = j;
+	r->queued++;
+	jobs_queued++;
+}
+
+static struct job * checksum_dequeue(void)
+{
+	struct job * j = checksum_head;
+
+	checksum_head = j->next;
+	if (checksum_head == NULL)
+		checksum_tail = NULL;
+
+	j->next = NULL;
+	checksum_queued--;
+
+	return j;
+}
+
+// queues job j; the checksum of the file, if its rule needs one, is computed first
+static void job_submit(struct job * j)
+{
+	if (j->rule->checksum == CHECKSUM_NONE || j->checksum[0] != 0) {
+		job_enqueue(j);
+		return;
+	}
+
+	rename_job_add(j);
+
+	j->next = NULL;
+
+	if (checksum_tail != NULL)
+		checksum_tail->next = j;
+	else
+		checksum_head = j;
+
+	checksum_tail = j;
+	checksum_queued++;
+}
+
+// sets the path of job j to file name of watched directory dir_pos
+static void job_set_path(struct job * j, int dir_pos, const char * name)
+{
+	const char * dir_name = watched_dirs[dir_pos];
+	size_t dir_len = strlen(dir_name);
+
+	// dir_name, '/' unless dir_name already ends with slash symbol, file name
+	j->dir_pos = dir_pos;
+	snprintf(j->path, sizeof(j->path), "%s%s%s", dir_name,
+			(dir_len > 0 && dir_name[dir_len - 1] == '/') ? "" : slash, name);
+}
+
+static void prefetch_started(struct job * j);
+
+static struct job * job_dequeue(struct rule * r)
+{
+	struct job * j;
+
+	do {
+		j = r->queue_head;
+
+		if (j == NULL)
+			return NULL;
+
+		r->queue_head = j->next;
+		if (r->queue_head == NULL)
+			r->queue_tail = NULL;
+
+		j->next = NULL;
+		r->queued--;
+		jobs_queued--;
+
+		if (r->prefetch_last == j)
+			r->prefetch_last = NULL;
+		if (j->prefetch_len > 0)
+			prefetch_started(j);
+
+		// the file is processed by the rule of its new name
+		if (j->renamed_away) {
+			job_free(j);
+			j = NULL;
+		}
+	} while (j == NULL);
+
+	rename_job_del(j);
+
+	return j;
+}
+
+
+/*
+ * page cache
+ *
+ * with --prefetch, the files of the jobs which are still queued after dispatch_jobs() are read
+ * ahead with posix_fadvise(POSIX_FADV_WILLNEED), oldest first, so that their handlers do not
+ * stall on cold reads when a slot frees up. the files read ahead by the jobs still queued take
+ * at most prefetch_budget bytes of page cache. the bytes already cached when a file is read
+ * ahead, and the ones still cached when its handler starts, are measured with cachestat()
+ * (mincore() before Linux 6.5) and exported as metrics.
+ */
+
+#ifndef SYS_cachestat
+#define SYS_cachestat 451
+#endif
+
+// struct cachestat_range and struct cachestat of linux/mman.h, which older headers do not have
+struct cache_range {
+	uint64_t off;
+	uint64_t len;
+};
+
+struct cache_stat {
+	uint64_t nr_cache;
+	uint64_t nr_dirty;
+	uint64_t nr_writeback;
+	uint64_t nr_evicted;
+	uint64_t nr_recently_evicted;
+};
+
+// bytes read ahead for the jobs still queued
+static int64_t prefetch_pending = 0;
+
+// bytes of the first len bytes of file fd which are in the page cache, -1 on error
+static int64_t file_cached_bytes(int fd, int64_t len)
+{
+	static bool no_cachestat = false;
+	int64_t page = sysconf(_SC_PAGESIZE);
+	int64_t cached = 0;
+
+	if (len <= 0)
+		return 0;
+
+	if (!no_cachestat) {
+		struct cache_range range = { .off = 0, .len = len };
+		struct cache_stat cs;
+
+		if (syscall(SYS_cachestat, fd, &range, &cs, 0) == 0)
+			return (int64_t) cs.nr_cache * page < len ? (int64_t) cs.nr_cache * page : len;
+
+		if (errno != ENOSYS)
+			return -1;
+
+		no_cachestat = true;
+	}
+
+	size_t pages = (len + page - 1) / page;
+	unsigned char * vec = malloc(pages);
+	void * p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (vec == NULL || p == MAP_FAILED || mincore(p, len, vec) == -1) {
+		cached = -1;
+	} else {
+		for (size_t i = 0; i < pages; i++)
+			cached += vec[i] & 1;
+		cached = cached * page < len ? cached * page : len;
+	}
+
+	if (p != MAP_FAILED)
+		munmap(p, len);
+	free(vec);
+
+	return cached;
+}
+
+// the file of job j (j->fd, or opened by path), -1 if it cannot be opened; see file_close()
+static int job_file(struct job * j)
+{
+	// O_NONBLOCK: a fifo does not block the main thread
+	return j->fd != -1 ? j->fd : open(j->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+}
+
+static void job_file_close(struct job * j, int fd)
+{
+	if (fd != j->fd)
+		close(fd);
+}
+
+// reads ahead up to budget bytes of the file of queued job j
+static void prefetch_job(struct job * j, int64_t budget)
+{
+	int fd = job_file(j);
+	struct stat st;
+
+	if (fd == -1)
+		return;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		int64_t len = st.st_size < budget ? st.st_size : budget;
+		int64_t cached = file_cached_bytes(fd, len);
+
+		if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) == 0) {
+			j->prefetch_len = len;
+			prefetch_pending += len;
+
+			stats.prefetch_files++;
+			stats.prefetch_bytes += len;
+			if (cached > 0)
+				stats.prefetch_cached_bytes += cached;
+		}
+	}
+
+	job_file_close(j, fd);
+}
+
+// reads ahead the files of the queued jobs, oldest first, while prefetch_budget allows;
+// rule r->prefetch_last and the jobs before it have already been looked at
+static void prefetch_jobs(void)
+{
+	for (int n = 0; n < rules_len && prefetch_pending < prefetch_budget; n++) {
+		struct rule * r = rules[(dispatch_next_rule + n) % rules_len];
+		struct job * j = r->prefetch_last != NULL ? r->prefetch_last->next : r->queue_head;
+
+		for (; j != NULL && prefetch_pending < prefetch_budget; j = j->next) {
+			// the bytes appended to a tail file have just been written: they are cached
+			if (j->tail == NULL)
+				prefetch_job(j, prefetch_budget - prefetch_pending);
+			r->prefetch_last = j;
+		}
+	}
+}
+
+// job j, whose file has been read ahead, leaves the queue
+static void prefetch_started(struct job * j)
+{
+	int fd = job_file(j);
+
+	if (fd != -1) {
+		int64_t cached = file_cached_bytes(fd, j->prefetch_len);
+
+		if (cached > 0)
+			stats.prefetch_resident_bytes += cached;
+		job_file_close(j, fd);
+	}
+
+	prefetch_pending -= j->prefetch_len;
+	j->prefetch_len = 0;
+}
+
+
+/*
+ * adaptive concurrency
+ *
+ * every AIMD_PERIOD_MS the controller looks at the handler run time of the jobs completed in
+ * the period and at the stall time reported by /proc/pressure/{cpu,io,memory}:
+ * if any of them is above its target, concurrency_limit is halved (multiplicative decrease),
+ * otherwise if jobs had to wait for a free slot, concurrency_limit grows by one (additive increase).
+ */
+
+struct psi_source {
+	const char * name;
+	const char * path;
+	int fd;
+	uint64_t total_us;          // cumulative "some" stall time, as read in the last period
+	double stall_pct;           // "some" stall time in the last period, percent of wall clock time
+	double avg10;               // "some avg10" as computed by the kernel
+};
+
+static struct psi_source psi[] = {
+	{ "cpu",    "/proc/pressure/cpu",    -1, 0, 0, 0 },
+	{ "io",     "/proc/pressure/io",     -1, 0, 0, 0 },
+	{ "memory", "/proc/pressure/memory", -1, 0, 0, 0 },
+};
+
+#define PSI_SOURCES (sizeof(psi) / sizeof(psi[0]))
+
+static struct {
+	uint64_t period_start_ns;
+	double latency_ewma_ms;     // handler run time, exponentially weighted over completed jobs
+	uint64_t latency_samples;   // jobs completed in the current period
+	bool saturated;             // jobs had to wait for a free slot in the current period
+	uint64_t increases;
+	uint64_t decreases;
+	const char * last_action;
+	const char * last_cause;
+} aimd = { 0, 0, 0, false, 0, 0, "hold", "none" };
+
+static void psi_open(void)
+{
+	for (size_t i = 0; i < PSI_SOURCES; i++) {
+		psi[i].fd = open(psi[i].path, O_RDONLY | O_CLOEXEC);
+		if (psi[i].fd == -1)
+			syslog(LOG_WARNING, "cannot open %s, pressure is not a controller input", psi[i].path);
+	}
+}
+
+static void psi_read(uint64_t elapsed_ns)
+{
+	char psi_buf[256];
+
+	for (size_t i = 0; i < PSI_SOURCES; i++) {
+		if (psi[i].fd == -1)
+			continue;
+
+		ssize_t n = pread(psi[i].fd, psi_buf, sizeof(psi_buf) - 1, 0);
+		if (n <= 0)
+			continue;
+		psi_buf[n] = 0;
+
+		// some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+		double avg10;
+		unsigned long long total;
+
+		if (sscanf(psi_buf, "some avg10=%lf avg60=%*f avg300=%*f total=%llu", &avg10, &total) != 2)
+			continue;
+
+		if (psi[i].total_us != 0 && elapsed_ns > 0 && total >= psi[i].total_us)
+			psi[i].stall_pct = (double) (total - psi[i].total_us) * 1000.0 * 100.0 / (double) elapsed_ns;
+
+		psi[i].total_us = total;
+		psi[i].avg10 = avg10;
+	}
+}
+
+static void dispatch_jobs(void);
+
+static void aimd_update(struct timer * t)
+{
+	uint64_t now = now_ns();
+	int old_limit = concurrency_limit;
+	const char * cause = NULL;
+
+	psi_read(now - aimd.period_start_ns);
+	aimd.period_start_ns = now;
+
+	for (size_t i = 0; i < PSI_SOURCES; i++) {
+		if (psi[i].stall_pct > psi_target) {
+			cause = psi[i].name;
+			break;
+		}
+	}
+
+	if (cause == NULL && latency_target_ms > 0 && aimd.latency_samples > 0
+			&& aimd.latency_ewma_ms > latency_target_ms)
+		cause = "latency";
+
+	if (cause != NULL) {
+		concurrency_limit = concurrency_limit / 2;
+		if (concurrency_limit < 1)
+			concurrency_limit = 1;
+
+		aimd.last_action = "decrease";
+		aimd.last_cause = cause;
+	} else if (aimd.saturated && concurrency_limit < max_jobs) {
+		concurrency_limit++;
+
+		aimd.last_action = "increase";
+		aimd.last_cause = "saturated";
+	} else {
+		aimd.last_action = "hold";
+		aimd.last_cause = aimd.saturated ? "max_jobs" : "idle";
+	}
+
+	if (concurrency_limit > old_limit)
+		aimd.increases++;
+	else if (concurrency_limit < old_limit)
+		aimd.decreases++;
+
+	if (concurrency_limit != old_limit)
+		syslog(LOG_INFO, "concurrency limit %d -> %d (%s)", old_limit, concurrency_limit, aimd.last_cause);
+
+	aimd.saturated = jobs_queued > 0 && jobs_running >= concurrency_limit;
+	aimd.latency_samples = 0;
+
+	timer_arm(t, t->deadline + AIMD_PERIOD_MS * NS_PER_MS);
+
+	dispatch_jobs();
+}
+
+static struct timer aimd_timer = TIMER_INIT(aimd_update, NULL);
+
+
+/*
+ * sharded readers
+ *
+ * a single inotify instance read by monitor() limits event intake to one core and one kernel
+ * queue (max_queued_events). with --readers N the watched directories are split among N inotify
+ * instances, each one read by a thread of its own pinned to a CPU. a reader resolves the watch
+ * descriptor of each event and copies the event to its ring, a single producer single consumer
+ * queue without locks, then signals shards_fd; monitor() drains the rings and handles the events
+ * as if it had read them itself (see process_event()).
+ * the events of a directory keep their order; the events of directories of different readers do
+ * not, e.g. the two halves of a rename between them.
+ * a reader whose ring is full waits until monitor() makes room: meanwhile the events wait in the
+ * kernel queue of its instance.
+ */
+
+#define SHARD_RING_SLOTS 4096       // power of 2
+#define SHARD_DRAIN 256             // events taken from each ring in an iteration of monitor()
+#define SHARD_BUF_LEN (64 * 1024)
+
+struct shard_event {
+	int dir_pos;                // -1 if the watch descriptor is unknown
+	uint64_t event_ts_ns;
+	char event[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+};
+
+struct shard {
+	int fd;                     // inotify instance, blocking
+	int dirs_len;
+	int * dir_pos;              // watched directories of the reader
+	int * wds;                  // and their watch descriptors
+	int cpu;                    // CPU of the reader
+	int space_fd;               // eventfd, blocking: the reader waits on it while the ring is full
+	pthread_t thread;
+	struct shard_event * ring;
+
+	// written by the reader
+	uint64_t tail __attribute__ ((aligned(64)));
+	uint64_t ring_full;         // times the reader has waited for room in the ring
+	int waiting;                // the reader waits on space_fd
+
+	// written by monitor()
+	uint64_t head __attribute__ ((aligned(64)));
+	uint64_t overflows;         // IN_Q_OVERFLOW of the inotify instance
+};
+
+static struct shard * shards = NULL;
+static int shards_len = 0;
+
+// eventfd: readers have added events to their rings
+static int shards_fd = -1;
+
+// a ring had more than SHARD_DRAIN events: monitor() drains it again without waiting
+static bool shards_pending = false;
+
+// creates the inotify instances of the readers, on the CPUs filemon may run on in turn
+static void shards_init(char_p directories[], int directories_len)
+{
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	int cpus_len = 0;
+	int dirs = 0;
+
+	for (int j = 0; j < directories_len; j++) {
+		if (directories[j] != NULL)
+			dirs++;
+	}
+
+	// a reader without directories would have nothing to read
+	shards_len = readers < dirs ? readers : dirs;
+	if (shards_len == 0)
+		shards_len = 1;
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == -1) {
+		syslog(LOG_ERR, "sched_getaffinity");
+		exit(EXIT_FAILURE);
+	}
+
+	// the CPU reserved to monitor() is left to it
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && cpu != reader_cpu)
+			cpus[cpus_len++] = cpu;
+	}
+	if (cpus_len == 0)
+		cpus[cpus_len++] = reader_cpu;
+
+	shards = calloc(shards_len, sizeof(struct shard));
+	shards_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shards == NULL || shards_fd == -1) {
+		syslog(LOG_ERR, "cannot create readers");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < shards_len; i++) {
+		struct shard * s = &shards[i];
+
+		s->fd = inotify_init1(IN_CLOEXEC);
+		s->space_fd = eventfd(0, EFD_CLOEXEC);
+		s->dir_pos = calloc(directories_len, sizeof(int));
+		s->wds = calloc(directories_len, sizeof(int));
+		s->ring = calloc(SHARD_RING_SLOTS, sizeof(struct shard_event));
+		s->cpu = cpus[i % cpus_len];
+
+		if (s->fd == -1 || s->space_fd == -1 || s->dir_pos == NULL || s->wds == NULL || s->ring == NULL) {
+			syslog(LOG_ERR, "cannot create readers");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// wakes up monitor()
+static void shard_signal(void)
+{
+	uint64_t one = 1;
+
+	if (write(shards_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "[reader] write to eventfd: %s", strerror(errno));
+}
+
+static void * shard_main(void * arg)
+{
+	struct shard * s = arg;
+	char rbuf[SHARD_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	uint64_t tail = s->tail;
+
+	for (;;) {
+		ssize_t n = read(s->fd, rbuf, sizeof(rbuf));
+
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+
+			syslog(LOG_ERR, "[reader] read() from inotify fd: %s", n == 0 ? "returned 0" : strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		// all of the events in buffer share the same timestamp
+		struct timespec event_ts;
+
+		clock_gettime(CLOCK_REALTIME, &event_ts);
+		uint64_t event_ts_ns = (uint64_t) event_ts.tv_sec * NS_PER_SEC + event_ts.tv_nsec;
+
+		for (char * p = rbuf; p < rbuf + n; ) {
+			struct inotify_event * event = (struct inotify_event *) p;
+			size_t size = sizeof(struct inotify_event) + event->len;
+
+			p += size;
+
+			while (tail - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) == SHARD_RING_SLOTS) {
+				// the events already in the ring are published first: monitor() makes room by handling them
+				__atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+				shard_signal();
+
+				// monitor() either sees waiting, or has moved head before it is read again here
+				__atomic_store_n(&s->waiting, 1, __ATOMIC_SEQ_CST);
+				if (tail - __atomic_load_n(&s->head, __ATOMIC_SEQ_CST) == SHARD_RING_SLOTS) {
+					uint64_t v;
+
+					__atomic_fetch_add(&s->ring_full, 1, __ATOMIC_RELAXED);
+					if (read(s->space_fd, &v, sizeof(v)) == -1 && errno != EINTR)
+						syslog(LOG_ERR, "[reader] read from eventfd: %s", strerror(errno));
+				}
+				__atomic_store_n(&s->waiting, 0, __ATOMIC_RELAXED);
+			}
+
+			struct shard_event * se = &s->ring[tail & (SHARD_RING_SLOTS - 1)];
+
+			se->dir_pos = -1;
+			for (int i = 0; i < s->dirs_len; i++) {
+				if (s->wds[i] == event->wd) {
+					se->dir_pos = s->dir_pos[i];
+					break;
+				}
+			}
+
+			se->event_ts_ns = event_ts_ns;
+			memcpy(se->event, event, size < sizeof(se->event) ? size : sizeof(se->event));
+			tail++;
+		}
+
+		__atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+		shard_signal();
+	}
+
+	return NULL;
+}
+
+// starts the readers; SIGTERM and SIGINT are left to the thread of monitor()
+static void shards_start(void)
+{
+	sigset_t old;
+
+	signals_block(&old);
+
+	for (int i = 0; i < shards_len; i++) {
+		struct shard * s = &shards[i];
+		pthread_attr_t attr;
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(s->cpu, &set);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+
+		int res = pthread_create(&s->thread, &attr, shard_main, s);
+
+		if (res != 0) {
+			syslog(LOG_ERR, "pthread_create: %s", strerror(res));
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_setname_np(s->thread, "filemon-reader");
+		pthread_attr_destroy(&attr);
+
+		syslog(LOG_INFO, "reader %d: %d directories, CPU %d", i, s->dirs_len, s->cpu);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void process_event(struct inotify_event * event, int dir_pos, uint64_t event_ts_ns);
+static void queue_overflow(int reader, uint64_t event_ts_ns);
+
+// handles the events in the rings of the readers, up to SHARD_DRAIN per ring
+static void shards_drain(void)
+{
+	uint64_t v;
+
+	// reset before the rings are looked at: events added later signal again
+	if (read(shards_fd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "read from eventfd: %s", strerror(errno));
+
+	shards_pending = false;
+
+	for (int i = 0; i < shards_len; i++) {
+		struct shard * s = &shards[i];
+		uint64_t head = s->head;
+		uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+
+		if (tail - head > SHARD_DRAIN) {
+			tail = head + SHARD_DRAIN;
+			shards_pending = true;
+		}
+
+		// the slot is reused by the reader only after head has moved past it
+		for (; head != tail; head++) {
+			struct shard_event * se = &s->ring[head & (SHARD_RING_SLOTS - 1)];
+			struct inotify_event * event = (struct inotify_event *) se->event;
+
+			// the overflow of a queue concerns its reader only
+			if (event->mask & IN_Q_OVERFLOW)
+				queue_overflow(i, se->event_ts_ns);
+			else
+				process_event(event, se->dir_pos, se->event_ts_ns);
+		}
+
+		__atomic_store_n(&s->head, head, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST)) {
+			uint64_t one = 1;
+
+			__atomic_store_n(&s->waiting, 0, __ATOMIC_RELAXED);
+			if (write(s->space_fd, &one, sizeof(one)) == -1)
+				syslog(LOG_ERR, "write to eventfd: %s", strerror(errno));
+		}
+	}
+}
+
+
+/*
+ * metrics
+ *
+ * written in Prometheus text format to metrics_file; the file is replaced atomically.
+ */
+
+static void write_metrics(FILE * f)
+{
+	fprintf(f, "filemon_events_total %llu\n", (unsigned long long) stats.events);
+	fprintf(f, "filemon_events_unmatched_total %llu\n", (unsigned long long) stats.events_unmatched);
+	fprintf(f, "filemon_events_filtered_total %llu\n", (unsigned long long) stats.events_filtered);
+	fprintf(f, "filemon_queue_overflows_total %llu\n", (unsigned long long) stats.queue_overflows);
+
+	for (int i = 0; i < includes_len; i++)
+		fprintf(f, "filemon_filter_hits_total{include=\"%s\"} %llu\n", includes[i].pattern, (unsigned long long) includes[i].hits);
+	for (int i = 0; i < excludes_len; i++)
+		fprintf(f, "filemon_filter_hits_total{exclude=\"%s\"} %llu\n", excludes[i].pattern, (unsigned long long) excludes[i].hits);
+
+	for (int i = 0; i < CONTENT_TYPES; i++) {
+		if (stats.content_sniffed[i] > 0)
+			fprintf(f, "filemon_content_sniffed_total{type=\"%s\"} %llu\n", content_types[i],
+					(unsigned long long) stats.content_sniffed[i]);
+	}
+	if (prefetch_budget > 0) {
+		fprintf(f, "filemon_prefetch_files_total %llu\n", (unsigned long long) stats.prefetch_files);
+		fprintf(f, "filemon_prefetch_bytes_total %llu\n", (unsigned long long) stats.prefetch_bytes);
+		fprintf(f, "filemon_prefetch_cached_bytes_total %llu\n", (unsigned long long) stats.prefetch_cached_bytes);
+		fprintf(f, "filemon_prefetch_resident_bytes_total %llu\n", (unsigned long long) stats.prefetch_resident_bytes);
+		fprintf(f, "filemon_prefetch_pending_bytes %lld\n", (long long) prefetch_pending);
+	}
+	for (int i = 0; i < shards_len; i++) {
+		struct shard * s = &shards[i];
+
+		fprintf(f, "filemon_reader_ring_events{reader=\"%d\"} %llu\n", i, (unsigned long long)
+				(__atomic_load_n(&s->tail, __ATOMIC_RELAXED) - s->head));
+		fprintf(f, "filemon_reader_ring_full_total{reader=\"%d\"} %llu\n", i,
+				(unsigned long long) __atomic_load_n(&s->ring_full, __ATOMIC_RELAXED));
+		fprintf(f, "filemon_reader_queue_overflows_total{reader=\"%d\"} %llu\n", i, (unsigned long long) s->overflows);
+	}
+	fprintf(f, "filemon_jobs_queued_total %llu\n", (unsigned long long) stats.jobs_queued);
+	fprintf(f, "filemon_jobs_started_total %llu\n", (unsigned long long) stats.jobs_started);
+	fprintf(f, "filemon_jobs_succeeded_total %llu\n", (unsigned long long) stats.jobs_succeeded);
+	fprintf(f, "filemon_jobs_failed_total %llu\n", (unsigned long long) stats.jobs_failed);
+	fprintf(f, "filemon_jobs_timed_out_total %llu\n", (unsigned long long) stats.jobs_timed_out);
+	fprintf(f, "filemon_jobs_killed_total %llu\n", (unsigned long long) stats.jobs_killed);
+	fprintf(f, "filemon_jobs_retried_total %llu\n", (unsigned long long) stats.jobs_retried);
+	fprintf(f, "filemon_jobs_dead_lettered_total %llu\n", (unsigned long long) stats.jobs_dead_lettered);
+	fprintf(f, "filemon_files_done_total %llu\n", (unsigned long long) stats.files_done);
+	fprintf(f, "filemon_dir_syncs_total %llu\n", (unsigned long long) stats.dir_syncs);
+	fprintf(f, "filemon_dir_sync_files_total %llu\n", (unsigned long long) stats.dir_sync_files);
+	fprintf(f, "filemon_dir_sync_errors_total %llu\n", (unsigned long long) stats.dir_sync_errors);
+	fprintf(f, "filemon_jobs_vanished_total %llu\n", (unsigned long long) stats.jobs_vanished);
+	fprintf(f, "filemon_job_run_seconds_total %.6f\n", (double) stats.job_run_ns / NS_PER_SEC);
+	fprintf(f, "filemon_job_wait_seconds_total %.6f\n", (double) stats.job_wait_ns / NS_PER_SEC);
+	fprintf(f, "filemon_job_spawn_seconds_total %.6f\n", (double) stats.job_spawn_ns / NS_PER_SEC);
+	fprintf(f, "filemon_jobs_running %d\n", jobs_running);
+	fprintf(f, "filemon_jobs_waiting %d\n", jobs_queued);
+	fprintf(f, "filemon_jobs_waiting_retry %d\n", jobs_retry_pending);
+	fprintf(f, "filemon_jobs_waiting_checksum %d\n", checksum_queued);
+	fprintf(f, "filemon_jobs_settling %d\n", settle_len);
+	fprintf(f, "filemon_settle_checks_total %llu\n", (unsigned long long) stats.settle_checks);
+	fprintf(f, "filemon_settle_merged_total %llu\n", (unsigned long long) stats.settle_merged);
+	fprintf(f, "filemon_batches_total %llu\n", (unsigned long long) stats.batches);
+	fprintf(f, "filemon_batches_pending %d\n", work_pending);
+
+	fprintf(f, "filemon_concurrency_limit %d\n", concurrency_limit);
+	fprintf(f, "filemon_concurrency_max %d\n", max_jobs);
+	fprintf(f, "filemon_concurrency_adaptive %d\n", adaptive ? 1 : 0);
+	fprintf(f, "filemon_aimd_increases_total %llu\n", (unsigned long long) aimd.increases);
+	fprintf(f, "filemon_aimd_decreases_total %llu\n", (unsigned long long) aimd.decreases);
+	fprintf(f, "filemon_aimd_last_decision{action=\"%s\",cause=\"%s\"} 1\n", aimd.last_action, aimd.last_cause);
+	fprintf(f, "filemon_aimd_job_latency_ewma_seconds %.6f\n", aimd.latency_ewma_ms / 1000.0);
+	fprintf(f, "filemon_aimd_job_latency_target_seconds %.6f\n", latency_target_ms / 1000.0);
+	fprintf(f, "filemon_aimd_psi_target_percent %.2f\n", psi_target);
+
+	for (int i = 0; i < rules_len; i++) {
+		struct rule * r = rules[i];
+
+		fprintf(f, "filemon_rule_events_matched_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->events_matched);
+		fprintf(f, "filemon_rule_jobs_waiting{rule=\"%s\"} %d\n", r->name, r->queued);
+		fprintf(f, "filemon_rule_jobs_succeeded_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->jobs_succeeded);
+		fprintf(f, "filemon_rule_jobs_failed_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->jobs_failed);
+		fprintf(f, "filemon_rule_jobs_timed_out_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->jobs_timed_out);
+		fprintf(f, "filemon_rule_jobs_killed_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->jobs_killed);
+		fprintf(f, "filemon_rule_jobs_retried_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->jobs_retried);
+		fprintf(f, "filemon_rule_jobs_dead_lettered_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->jobs_dead_lettered);
+		fprintf(f, "filemon_rule_files_done_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->files_done);
+
+		if (r->plugin_ops != NULL)
+			fprintf(f, "filemon_rule_batches_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->batches);
+
+		if (r->checksum != CHECKSUM_NONE)
+			fprintf(f, "filemon_rule_checksum_bytes_total{rule=\"%s\"} %llu\n", r->name,
+					(unsigned long long) __atomic_load_n(&r->checksum_bytes, __ATOMIC_RELAXED));
+
+		if (r->action == ACTION_COPY) {
+			fprintf(f, "filemon_rule_copy_bytes_total{rule=\"%s\"} %llu\n", r->name,
+					(unsigned long long) __atomic_load_n(&r->copy_bytes, __ATOMIC_RELAXED));
+			fprintf(f, "filemon_rule_copy_reflinks_total{rule=\"%s\"} %llu\n", r->name,
+					(unsigned long long) __atomic_load_n(&r->copy_reflinks, __ATOMIC_RELAXED));
+		}
+
+		if (r->stdin_mode == STDIN_PIPE)
+			fprintf(f, "filemon_rule_stdin_bytes_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->stdin_bytes);
+
+		if (r->evict) {
+			fprintf(f, "filemon_rule_evicted_bytes_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->evicted_bytes);
+			fprintf(f, "filemon_rule_evict_writebacks_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->evict_writebacks);
+		}
+
+		if (r->rename_commit) {
+			fprintf(f, "filemon_rule_temp_closes_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->temp_closes);
+			fprintf(f, "filemon_rule_renames_retargeted_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->renames_retargeted);
+			fprintf(f, "filemon_rule_renames_skipped_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->renames_skipped);
+			fprintf(f, "filemon_rule_renames_rerouted_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->renames_rerouted);
+		}
+
+		if (r->group_marker != NULL) {
+			fprintf(f, "filemon_rule_group_files_waiting{rule=\"%s\"} %d\n", r->name, r->group_waiting);
+			fprintf(f, "filemon_rule_groups_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->groups);
+		}
+
+		if (r->tail) {
+			fprintf(f, "filemon_rule_tail_files{rule=\"%s\"} %d\n", r->name, r->tail_files);
+			fprintf(f, "filemon_rule_tail_truncations_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->tail_truncations);
+			fprintf(f, "filemon_rule_tail_rotations_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->tail_rotations);
+		}
+
+		if (r->output_log != NULL)
+			fprintf(f, "filemon_rule_output_bytes_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->output_bytes);
+
+		char label[256];
+
+		snprintf(label, sizeof(label), "rule=\"%s\"", r->name);
+		write_usage_metrics(f, label, &r->usage);
+
+		if (r->breaker_threshold > 0) {
+			fprintf(f, "filemon_rule_breaker_state{rule=\"%s\",state=\"%s\"} %d\n", r->name,
+					breaker_states[r->breaker_state], r->breaker_state);
+			fprintf(f, "filemon_rule_breaker_failure_percent{rule=\"%s\"} %d\n", r->name, breaker_failure_percent(r));
+			fprintf(f, "filemon_rule_breaker_opened_total{rule=\"%s\"} %llu\n", r->name, (unsigned long long) r->breaker_opened);
+		}
+	}
+
+	for (int i = 0; i < watched_dirs_len; i++) {
+		char label[PATH_MAX + 16];
+
+		if (watched_dirs[i] == NULL)
+			continue;
+
+		snprintf(label, sizeof(label), "dir=\"%s\"", watched_dirs[i]);
+		write_usage_metrics(f, label, &dir_usage[i]);
+	}
+
+	for (size_t i = 0; i < PSI_SOURCES; i++) {
+		if (psi[i].fd == -1)
+			continue;
+
+		fprintf(f, "filemon_psi_some_stall_percent{resource=\"%s\"} %.2f\n", psi[i].name, psi[i].stall_pct);
+		fprintf(f, "filemon_psi_some_avg10_percent{resource=\"%s\"} %.2f\n", psi[i].name, psi[i].avg10);
+	}
+}
+
+static void metrics_update(struct timer * t)
+{
+	char tmp_name[PATH_MAX];
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", metrics_file);
+
+	FILE * f = fopen(tmp_name, "we");
+	if (f == NULL) {
+		syslog(LOG_ERR, "cannot write metrics file %s", tmp_name);
+	} else {
+		write_metrics(f);
+
+		if (fclose(f) != 0 || rename(tmp_name, metrics_file) == -1)
+			syslog(LOG_ERR, "cannot write metrics file %s", metrics_file);
+	}
+
+	timer_arm(t, t->deadline + METRICS_PERIOD_MS * NS_PER_MS);
+}
+
+static struct timer metrics_timer = TIMER_INIT(metrics_update, NULL);
+
+
+/*
+ * handlers
+ */
+
+// glibc provides wrappers for these system calls only since 2.36
+static int sys_pidfd_open(pid_t pid, unsigned int flags)
+{
+	return syscall(SYS_pidfd_open, pid, flags);
+}
+
+static int sys_pidfd_send_signal(int pidfd, int sig, siginfo_t * info, unsigned int flags)
+{
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags);
+}
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+// struct clone_args of clone3(), see linux/sched.h
+struct clone3_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+};
+
+static pid_t sys_clone3(struct clone3_args * args)
+{
+	return syscall(SYS_clone3, args, sizeof(struct clone3_args));
+}
+
+// number of the file descriptor which refers to the file, when the rule has pass_fd
+#define HANDLER_FD 3
+
+#define SPAWN_MAX_FDS 4
+
+/*
+ * handler environment
+ *
+ * handlers receive the environment of filemon plus the FILEMON_* variables which describe the job.
+ * handler_envp is built once at startup: the environment of filemon followed by ENV_COUNT free slots;
+ * for each job the variables are formatted in spawn_req.env and the child points the slots at them,
+ * so that no memory is allocated per job.
+ */
+
+enum {
+	ENV_PATH,                   // absolute path of the file
+	ENV_DIR,                    // watched directory
+	ENV_NAME,                   // file name, relative to ENV_DIR
+	ENV_MASK,                   // inotify mask of the event, hexadecimal
+	ENV_SIZE,                   // file size, bytes
+	ENV_INODE,
+	ENV_MTIME_NS,               // file modification time, ns since the epoch
+	ENV_EVENT_TS_NS,            // when filemon has read the event, ns since the epoch
+	ENV_QUEUE_WAIT_NS,          // time spent by the job in the queue, ns
+	ENV_FD,                     // HANDLER_FD, if the rule has pass_fd
+	ENV_CHECKSUM,               // "algorithm:hex digits", if the rule has checksum
+	ENV_OFFSET,                 // tail: offset of the first byte on stdin
+	ENV_LENGTH,                 // tail: bytes on stdin
+	ENV_GROUP_SIZE,             // group: number of files passed as arguments
+	ENV_GROUP_MARKER,           // group: path of the marker file, if the group has one
+	ENV_CONTENT_TYPE,           // type of the content, if the rule has content_types
+	ENV_COUNT
+};
+
+#define ENV_BUF_LEN (3 * PATH_MAX + NAME_MAX + 512)
+
+// group: bytes of the paths passed to a handler as arguments
+#define GROUP_ARGS_LEN (128 * 1024)
+
+static char ** handler_envp = NULL;
+static int handler_envp_base = 0;      // first FILEMON_* slot in handler_envp
+
+// everything a process needs to start a handler; sent as is to the zygote, together with
+// the file descriptors to install in the handler (SCM_RIGHTS)
+struct spawn_req {
+	uint64_t cookie;            // identifies the job in the reply of the zygote
+	int fd_count;
+	int fd_target[SPAWN_MAX_FDS];   // number of each file descriptor in the handler
+	bool has_cpus;              // scheduling attributes of the handler, see struct rule
+	cpu_set_t cpus;
+	int nice;
+	int ioprio;
+	bool sched_idle;
+	int env_count;
+	uint16_t env_offset[ENV_COUNT];    // "FILEMON_...=value" strings in env
+	char env[ENV_BUF_LEN];
+	int argc;                   // arguments of sh after cmd, each one terminated by 0
+	char cmd[MAX_COMMAND_LEN + PATH_MAX + 2 + GROUP_ARGS_LEN];  // must be the last field
+};
+
+// builds handler_envp; FILEMON_* variables inherited by filemon are not passed to handlers
+static void handler_env_init(void)
+{
+	int n = 0;
+
+	for (char ** e = environ; *e != NULL; e++)
+		n++;
+
+	handler_envp = calloc(n + ENV_COUNT + 1, sizeof(char *));
+	if (handler_envp == NULL) {
+		syslog(LOG_ERR, "cannot allocate handler environment");
+		exit(EXIT_FAILURE);
+	}
+
+	for (char ** e = environ; *e != NULL; e++) {
+		if (strncmp(*e, "FILEMON_", 8) != 0)
+			handler_envp[handler_envp_base++] = *e;
+	}
+}
+
+// appends NAME=value to the environment of req
+static void spawn_req_setenv(struct spawn_req * req, size_t * used, const char * name, const char * fmt, ...)
+	__attribute__ ((format (printf, 4, 5)));
+
+static void spawn_req_setenv(struct spawn_req * req, size_t * used, const char * name, const char * fmt, ...)
+{
+	va_list ap;
+	int n = snprintf(req->env + *used, sizeof(req->env) - *used, "%s=", name);
+
+	va_start(ap, fmt);
+	n += vsnprintf(req->env + *used + n, sizeof(req->env) - *used - n, fmt, ap);
+	va_end(ap);
+
+	if (*used + n + 1 > sizeof(req->env))
+		return;
+
+	req->env_offset[req->env_count++] = *used;
+	*used += n + 1;
+}
+
+// appends an argument of sh after the command; the size of the group is limited by group_submit()
+static void spawn_req_addarg(struct spawn_req * req, size_t * cmd_len, const char * arg)
+{
+	size_t len = strlen(arg) + 1;
+
+	memcpy(req->cmd + *cmd_len, arg, len);
+	*cmd_len += len;
+	req->argc++;
+}
+
+struct spawn_reply {
+	uint64_t cookie;
+	pid_t pid;
+	int error;                  // errno of clone3(), 0 on success
+};
+
+static struct spawn_req spawn_req_buf;
+
+// file descriptors which become spawn_req_buf.fd_target[] in the handler
+static int spawn_fds[SPAWN_MAX_FDS];
+
+// socket connected to the zygote, -1 if handlers are forked by filemon itself (--zygote)
+static int zygote_fd = -1;
+
+// reports an error of the child process on its stderr (the output log of the handler, once
+// installed by exec_handler()): the child of a multithreaded process may only use async-signal-safe functions,
+// syslog() and strerror() could wait forever for a lock held by another thread at fork time
+static void child_error(const char * what, int err)
+{
+	char buf[128];
+	size_t len = 0;
+	char num[12];
+	int n = 0;
+
+	for (const char * s = "filemon [child process] "; *s != 0; s++)
+		buf[len++] = *s;
+	for (; *what != 0 && len < sizeof(buf) - sizeof(num) - 10; what++)
+		buf[len++] = *what;
+
+	for (const char * s = ": errno "; *s != 0; s++)
+		buf[len++] = *s;
+	do {
+		num[n++] = '0' + err % 10;
+		err /= 10;
+	} while (err > 0 && n < (int) sizeof(num));
+	while (n > 0)
+		buf[len++] = num[--n];
+	buf[len++] = '\n';
+
+	ssize_t ret = write(STDERR_FILENO, buf, len);
+	(void) ret;
+}
+
+// runs in the child process: never returns; only async-signal-safe functions may be called
+// here, filemon is multithreaded when handlers are forked by the process itself (see child_error)
+static void exec_handler(const struct spawn_req * req, const int * fds)
+{
+	// the handler leads its own process group, so that a timeout reaches the processes it starts
+	if (setpgid(0, 0) == -1)
+		child_error("setpgid", errno);
+
+	// scheduling attributes, before stderr is replaced: failures are logged, the handler is
+	// started anyway
+	if (req->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &req->cpus) == -1)
+		child_error("sched_setaffinity", errno);
+
+	if (req->nice != NICE_UNSET && setpriority(PRIO_PROCESS, 0, req->nice) == -1)
+		child_error("setpriority", errno);
+
+	if (req->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, req->ioprio) == -1)
+		child_error("ioprio_set", errno);
+
+	if (req->sched_idle) {
+		struct sched_param param = { .sched_priority = 0 };
+
+		if (sched_setscheduler(0, SCHED_IDLE, &param) == -1)
+			child_error("sched_setscheduler", errno);
+	}
+
+	// move the file descriptors out of the way of the targets first, then install them;
+	// dup2() clears FD_CLOEXEC on the new descriptor
+	int moved[SPAWN_MAX_FDS];
+
+	for (int i = 0; i < req->fd_count; i++) {
+		moved[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 64);
+		if (moved[i] == -1) {
+			child_error("fcntl", errno);
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	for (int i = 0; i < req->fd_count; i++) {
+		if (dup2(moved[i], req->fd_target[i]) == -1) {
+			child_error("dup2", errno);
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	// this is the copy of handler_envp of the child process
+	for (int i = 0; i < req->env_count; i++)
+		handler_envp[handler_envp_base + i] = (char *) req->env + req->env_offset[i];
+	handler_envp[handler_envp_base + req->env_count] = NULL;
+
+	// filemon ignores SIGPIPE (see STDIN_PIPE), which would be inherited through exec
+	signal(SIGPIPE, SIG_DFL);
+
+	if (req->argc > 0) {
+		// sh -c 'command "$@"' sh file1 file2 ...
+		const char * argv[req->argc + 5];
+		const char * arg = req->cmd + strlen(req->cmd) + 1;
+
+		argv[0] = "sh";
+		argv[1] = "-c";
+		argv[2] = req->cmd;
+		argv[3] = "sh";
+		for (int i = 0; i < req->argc; i++) {
+			argv[4 + i] = arg;
+			arg += strlen(arg) + 1;
+		}
+		argv[4 + req->argc] = NULL;
+
+		execve("/bin/sh", (char * const *) argv, handler_envp);
+		child_error("execve", errno);
+		_exit(EXIT_FAILURE);
+	}
+
+	execle("/bin/sh", "sh", "-c", req->cmd, (char *) NULL, handler_envp);
+	child_error("execle", errno);
+	_exit(EXIT_FAILURE);
+}
+
+/*
+ * zygote
+ *
+ * a small process forked at startup, before filemon allocates its data structures, which forks
+ * handlers on behalf of filemon: the cost of fork() grows with the memory mapped by the process
+ * which calls it, the zygote keeps it at its minimum.
+ * handlers are created with CLONE_PARENT, so they are children of filemon which reaps them as usual;
+ * their pidfd is sent back to filemon with SCM_RIGHTS.
+ */
+
+static void zygote_loop(int sock)
+{
+	// the zygote does not outlive filemon
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	for (;;) {
+		struct iovec req_iov = { &spawn_req_buf, sizeof(spawn_req_buf) };
+		union {
+			char buf[CMSG_SPACE(sizeof(int) * SPAWN_MAX_FDS)];
+			struct cmsghdr align;
+		} req_control;
+		struct msghdr req_msg = {
+				.msg_iov = &req_iov, .msg_iovlen = 1,
+				.msg_control = req_control.buf, .msg_controllen = sizeof(req_control.buf)
+		};
+
+		ssize_t n = recvmsg(sock, &req_msg, MSG_CMSG_CLOEXEC);
+		if (n == 0)
+			_exit(EXIT_SUCCESS);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			syslog(LOG_ERR, "[zygote] recv");
+			_exit(EXIT_FAILURE);
+		}
+
+		struct cmsghdr * req_cmsg = CMSG_FIRSTHDR(&req_msg);
+		int fd_count = 0;
+
+		if (req_cmsg != NULL && req_cmsg->cmsg_level == SOL_SOCKET && req_cmsg->cmsg_type == SCM_RIGHTS) {
+			fd_count = (req_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(spawn_fds, CMSG_DATA(req_cmsg), sizeof(int) * fd_count);
+		}
+
+		if (fd_count != spawn_req_buf.fd_count) {
+			syslog(LOG_ERR, "[zygote] file descriptors missing in spawn request");
+			_exit(EXIT_FAILURE);
+		}
+
+		int pidfd = -1;
+		// with CLONE_PARENT, exit_signal must be 0: the handler inherits the exit signal of
+		// the zygote, SIGCHLD, as filemon forked it
+		struct clone3_args args = {
+				.flags = CLONE_PARENT | CLONE_PIDFD,
+				.pidfd = (uintptr_t) &pidfd,
+				.exit_signal = 0,
+		};
+
+		pid_t pid = sys_clone3(&args);
+		if (pid == 0)
+			exec_handler(&spawn_req_buf, spawn_fds);
+
+		for (int i = 0; i < fd_count; i++)
+			close(spawn_fds[i]);
+
+		struct spawn_reply reply = { spawn_req_buf.cookie, pid, pid == -1 ? errno : 0 };
+		struct iovec iov = { &reply, sizeof(reply) };
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+		if (pid != -1) {
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+
+			struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+		}
+
+		if (sendmsg(sock, &msg, 0) == -1) {
+			syslog(LOG_ERR, "[zygote] sendmsg");
+			_exit(EXIT_FAILURE);
+		}
+
+		if (pidfd != -1)
+			close(pidfd);
+	}
+}
+
+static void zygote_start(void)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		syslog(LOG_ERR, "socketpair");
+		exit(EXIT_FAILURE);
+	}
+
+	switch (fork()) {
+	case -1:
+		perror("cannot fork");
+		exit(EXIT_FAILURE);
+	case 0:
+		close(sv[0]);
+		zygote_loop(sv[1]);
+		break;
+	default:
+		close(sv[1]);
+		zygote_fd = sv[0];
+	}
+}
+
+/*
+ * handler output
+ *
+ * when the rule has output_log, stdout and stderr of each handler are connected to a pipe;
+ * monitor() moves the data from the pipe to output_log with splice(), without copying it
+ * to user space. a line with pid and file name is written before the output of each handler,
+ * every time the output of another handler has been written in between.
+ * the pipe capacity bounds the buffered output: a handler blocks when its pipe is full.
+ */
+
+static void output_log_open(struct rule * r)
+{
+	struct stat st;
+
+	// splice() cannot write to a file opened with O_APPEND: writes use output_offset
+	r->output_fd = open(r->output_log, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (r->output_fd == -1 || fstat(r->output_fd, &st) == -1) {
+		syslog(LOG_ERR, "rule %s: cannot open output log %s", r->name, r->output_log);
+		exit(EXIT_FAILURE);
+	}
+
+	r->output_offset = st.st_size;
+	r->output_writer = NULL;
+}
+
+// output_log -> output_log.1 -> ... -> output_log.<output_log_keep>
+static void output_log_rotate(struct rule * r)
+{
+	char from[PATH_MAX + 16];
+	char to[PATH_MAX + 16];
+
+	close(r->output_fd);
+
+	for (int k = r->output_log_keep; k > 0; k--) {
+		if (k > 1)
+			snprintf(from, sizeof(from), "%s.%d", r->output_log, k - 1);
+		else
+			snprintf(from, sizeof(from), "%s", r->output_log);
+		snprintf(to, sizeof(to), "%s.%d", r->output_log, k);
+
+		if (rename(from, to) == -1 && errno != ENOENT)
+			syslog(LOG_ERR, "rule %s: cannot rotate %s", r->name, from);
+	}
+
+	if (r->output_log_keep == 0 && unlink(r->output_log) == -1)
+		syslog(LOG_ERR, "rule %s: cannot rotate %s", r->name, r->output_log);
+
+	output_log_open(r);
+}
+
+// moves the output available in the pipe of job j to the output log of its rule
+static void job_output(struct job * j)
+{
+	struct rule * r = j->rule;
+
+	for (;;) {
+		if (r->output_writer != j) {
+			char header[PATH_MAX + 64];
+			char last = '\n';
+
+			// the output of the previous handler may end in the middle of a line
+			if (r->output_offset > 0 && pread(r->output_fd, &last, 1, r->output_offset - 1) != 1)
+				last = '\n';
+
+			int len = snprintf(header, sizeof(header), "%s--- [pid=%d] %s\n", last == '\n' ? "" : "\n", j->pid, j->path);
+
+			if (pwrite(r->output_fd, header, len, r->output_offset) == len)
+				r->output_offset += len;
+			r->output_writer = j;
+		}
+
+		loff_t off = r->output_offset;
+		ssize_t n = splice(j->output_fd, NULL, r->output_fd, &off, 1 << 20, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if (n > 0) {
+			r->output_offset = off;
+			r->output_bytes += n;
+
+			if (r->output_log_size > 0 && r->output_offset >= r->output_log_size)
+				output_log_rotate(r);
+			continue;
+		}
+
+		if (n == -1 && errno == EAGAIN)
+			return;
+
+		if (n == -1)
+			syslog(LOG_ERR, "rule %s: splice to output log: %s", r->name, strerror(errno));
+
+		// end of file: the handler, and any process it has started, has closed stdout and stderr
+		close(j->output_fd);
+		j->output_fd = -1;
+		return;
+	}
+}
+
+// the handler of job j has terminated: what is left in the pipe is its last output
+static void job_output_close(struct job * j)
+{
+	if (j->output_fd == -1)
+		return;
+
+	job_output(j);
+
+	if (j->output_fd != -1) {
+		close(j->output_fd);
+		j->output_fd = -1;
+	}
+
+	if (j->rule->output_writer == j)
+		j->rule->output_writer = NULL;
+}
+
+/*
+ * handler input
+ *
+ * with STDIN_FILE, stdin of the handler is the file itself, opened read only: filemon does not
+ * touch the data. with STDIN_PIPE, stdin is a pipe: whenever the pipe has room, monitor() moves
+ * the next part of the file into it with splice(), without copying it to user space. handlers
+ * read a stream, e.g. compressors and log shippers, and may stop reading at any time.
+ */
+
+// opens the file of job j for reading, as a new open file description: its offset is not shared
+static int job_open_file(struct job * j)
+{
+	char proc_path[32];
+	int fd = j->tail != NULL ? j->tail->fd : j->fd;
+
+	// the file opened when the event has been read (or followed by tail), even if it has been
+	// renamed in the meantime
+	if (fd != -1) {
+		snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+		return open(proc_path, O_RDONLY | O_CLOEXEC);
+	}
+
+	if (dir_fds[j->dir_pos] != -1)
+		return openat(dir_fds[j->dir_pos], strrchr(j->path, '/') + 1, O_RDONLY | O_CLOEXEC);
+
+	return open(j->path, O_RDONLY | O_CLOEXEC);
+}
+
+static void job_stdin_close(struct job * j)
+{
+	if (j->stdin_fd != -1) {
+		close(j->stdin_fd);
+		j->stdin_fd = -1;
+	}
+
+	if (j->stdin_src != -1) {
+		close(j->stdin_src);
+		j->stdin_src = -1;
+	}
+}
+
+// moves the file of job j to the stdin pipe of its handler while the pipe has room
+static void job_stdin(struct job * j)
+{
+	for (;;) {
+		size_t len = 1 << 20;
+
+		if (j->stdin_end != -1 && (loff_t) len > j->stdin_end - j->stdin_off)
+			len = j->stdin_end - j->stdin_off;
+
+		ssize_t n = len > 0 ? splice(j->stdin_src, &j->stdin_off, j->stdin_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK) : 0;
+
+		if (n > 0) {
+			j->rule->stdin_bytes += n;
+			continue;
+		}
+
+		if (n == -1 && errno == EAGAIN)
+			return;
+
+		// EPIPE: the handler has closed stdin before the end of the file
+		if (n == -1 && errno != EPIPE)
+			syslog(LOG_ERR, "[parent] splice to stdin of pid=%d: %s", j->pid, strerror(errno));
+
+		// end of file, or stdin_end: the handler reads EOF
+		job_stdin_close(j);
+		return;
+	}
+}
+
+static void job_timeout(struct timer * t);
+static void job_failed(struct job * j, const char * reason);
+static void job_failed_early(struct job * j, const char * reason);
+
+// formats the FILEMON_* variables of job j in req
+static void job_env(struct job * j, struct spawn_req * req)
+{
+	size_t used = 0;
+	char * slash_pos = strrchr(j->path, '/');
+	struct stat st;
+	int res;
+
+	req->env_count = 0;
+
+	spawn_req_setenv(req, &used, "FILEMON_PATH", "%s", j->path);
+	spawn_req_setenv(req, &used, "FILEMON_DIR", "%.*s", slash_pos == j->path ? 1 : (int) (slash_pos - j->path), j->path);
+	spawn_req_setenv(req, &used, "FILEMON_NAME", "%s", slash_pos + 1);
+	spawn_req_setenv(req, &used, "FILEMON_MASK", "0x%08x", j->mask);
+
+	// a single stat per job, here, instead of one in each handler
+	if (j->fd != -1)
+		res = fstat(j->fd, &st);
+	else if (dir_fds[j->dir_pos] != -1)
+		res = fstatat(dir_fds[j->dir_pos], slash_pos + 1, &st, 0);
+	else
+		res = stat(j->path, &st);
+
+	if (res == 0) {
+		spawn_req_setenv(req, &used, "FILEMON_SIZE", "%lld", (long long) st.st_size);
+		spawn_req_setenv(req, &used, "FILEMON_INODE", "%llu", (unsigned long long) st.st_ino);
+		spawn_req_setenv(req, &used, "FILEMON_MTIME_NS", "%llu",
+				(unsigned long long) st.st_mtim.tv_sec * NS_PER_SEC + st.st_mtim.tv_nsec);
+	}
+
+	spawn_req_setenv(req, &used, "FILEMON_EVENT_TS_NS", "%llu", (unsigned long long) j->event_ts_ns);
+	spawn_req_setenv(req, &used, "FILEMON_QUEUE_WAIT_NS", "%llu", (unsigned long long) (j->start_ns - j->enqueue_ns));
+
+	if (j->fd != -1)
+		spawn_req_setenv(req, &used, "FILEMON_FD", "%d", HANDLER_FD);
+
+	if (j->checksum[0] != 0)
+		spawn_req_setenv(req, &used, "FILEMON_CHECKSUM", "%s", j->checksum);
+
+	if (j->tail != NULL) {
+		spawn_req_setenv(req, &used, "FILEMON_OFFSET", "%lld", (long long) j->stdin_start);
+		spawn_req_setenv(req, &used, "FILEMON_LENGTH", "%lld", (long long) (j->stdin_end - j->stdin_start));
+	}
+
+	if (j->content_type >= 0)
+		spawn_req_setenv(req, &used, "FILEMON_CONTENT_TYPE", "%s", content_types[j->content_type]);
+
+	if (j->group_size > 0) {
+		spawn_req_setenv(req, &used, "FILEMON_GROUP_SIZE", "%d", j->group_size);
+		if (j->group_marker)
+			spawn_req_setenv(req, &used, "FILEMON_GROUP_MARKER", "%s", j->path);
+	}
+}
+
+// the handler of job j is running as process pid
+static void job_spawned(struct job * j, pid_t pid, int pidfd)
+{
+	uint64_t now = now_ns();
+
+	j->pid = pid;
+	j->pidfd = pidfd;
+
+	syslog(LOG_INFO, "[parent] started pid=%d (%s)", pid, j->path);
+
+	stats.job_spawn_ns += now - j->start_ns;
+
+	if (j->rule->timeout_ms > 0) {
+		j->timer.fn = job_timeout;
+		j->timer.arg = j;
+		timer_arm(&j->timer, now + j->rule->timeout_ms * NS_PER_MS);
+	}
+}
+
+static void start_job(struct job * j)
+{
+	struct spawn_req * req = &spawn_req_buf;
+	pid_t child_pid;
+	int output_pipe[2] = { -1, -1 };
+	int stdin_child = -1;       // stdin of the handler, closed by filemon after the spawn
+
+	if (j->rule->stdin_mode != STDIN_NONE) {
+		int src = job_open_file(j);
+
+		if (src == -1) {
+			syslog(LOG_WARNING, "cannot open %s: %s", j->path, strerror(errno));
+			job_failed_early(j, "open");
+			return;
+		}
+
+		if (j->rule->stdin_mode == STDIN_FILE) {
+			stdin_child = src;
+		} else {
+			int stdin_pipe[2];
+
+			if (pipe2(stdin_pipe, O_CLOEXEC) == -1) {
+				syslog(LOG_ERR, "[parent] pipe2");
+				exit(EXIT_FAILURE);
+			}
+
+			// fewer wake ups; the default size is used if the limit of the user is reached
+			fcntl(stdin_pipe[1], F_SETPIPE_SZ, 1 << 20);
+			fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
+
+			stdin_child = stdin_pipe[0];
+			j->stdin_fd = stdin_pipe[1];
+			j->stdin_src = src;
+			j->stdin_off = j->stdin_start;
+		}
+	}
+
+	req->cookie = (uintptr_t) j;
+	req->fd_count = 0;
+
+	if (stdin_child != -1) {
+		spawn_fds[req->fd_count] = stdin_child;
+		req->fd_target[req->fd_count++] = STDIN_FILENO;
+	}
+
+	if (j->fd != -1) {
+		spawn_fds[req->fd_count] = j->fd;
+		req->fd_target[req->fd_count++] = HANDLER_FD;
+	}
+
+	if (j->rule->output_fd != -1) {
+		if (pipe2(output_pipe, O_CLOEXEC) == -1) {
+			syslog(LOG_ERR, "[parent] pipe2");
+			exit(EXIT_FAILURE);
+		}
+
+		fcntl(output_pipe[0], F_SETFL, O_NONBLOCK);
+		j->output_fd = output_pipe[0];
+
+		spawn_fds[req->fd_count] = output_pipe[1];
+		req->fd_target[req->fd_count++] = STDOUT_FILENO;
+		spawn_fds[req->fd_count] = output_pipe[1];
+		req->fd_target[req->fd_count++] = STDERR_FILENO;
+	}
+
+	j->start_ns = now_ns();
+	j->term_sent = false;
+
+	job_env(j, req);
+
+	// handlers do not inherit the CPU reserved to filemon (--reader-cpu)
+	req->has_cpus = j->rule->has_cpus || reader_cpu >= 0;
+	req->cpus = j->rule->has_cpus ? j->rule->cpus : handler_cpus;
+	req->nice = j->rule->nice;
+	req->ioprio = j->rule->ioprio;
+	req->sched_idle = j->rule->sched_idle;
+
+	size_t cmd_len;
+
+	req->argc = 0;
+
+	if (j->group_size > 0) {
+		// command "$@", followed by the files of the group, which become the arguments of sh
+		cmd_len = snprintf(req->cmd, sizeof(req->cmd), "%s \"$@\"", j->rule->command) + 1;
+
+		// the job of a group without marker is the one of its first file
+		if (!j->group_marker)
+			spawn_req_addarg(req, &cmd_len, j->path);
+
+		for (struct job * m = j->members; m != NULL; m = m->next)
+			spawn_req_addarg(req, &cmd_len, m->path);
+
+		syslog(LOG_INFO, "cmd: %s (%d files)", req->cmd, req->argc);
+	} else {
+		// command, ' ', absolute file name
+		cmd_len = snprintf(req->cmd, sizeof(req->cmd), "%s%s%s", j->rule->command, space, j->path) + 1;
+
+		syslog(LOG_INFO, "cmd: %s", req->cmd);
+	}
+
+	running[jobs_running++] = j;
+
+	stats.jobs_started++;
+	stats.job_wait_ns += j->start_ns - j->enqueue_ns;
+
+	if (zygote_fd != -1) {
+		// job_spawned() is called when the reply of the zygote is received
+		struct iovec iov = { req, offsetof(struct spawn_req, cmd) + cmd_len };
+		union {
+			char buf[CMSG_SPACE(sizeof(int) * SPAWN_MAX_FDS)];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+		if (req->fd_count > 0) {
+			msg.msg_control = control.buf;
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * req->fd_count);
+
+			struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * req->fd_count);
+			memcpy(CMSG_DATA(cmsg), spawn_fds, sizeof(int) * req->fd_count);
+		}
+
+		if (sendmsg(zygote_fd, &msg, 0) == -1) {
+			syslog(LOG_ERR, "[parent] send to zygote");
+			exit(EXIT_FAILURE);
+		}
+
+		if (output_pipe[1] != -1)
+			close(output_pipe[1]);
+		if (stdin_child != -1)
+			close(stdin_child);
+		return;
+	}
+
+	switch (child_pid = fork()) {
+	case -1:
+		perror("cannot fork");
+		exit(EXIT_FAILURE);
+	case 0:
+		exec_handler(req, spawn_fds);
+		break;
+	default:
+		;
+	}
+
+	if (output_pipe[1] != -1)
+		close(output_pipe[1]);
+	if (stdin_child != -1)
+		close(stdin_child);
+
+	// pidfd_open() returns a file descriptor which becomes readable when the process terminates;
+	// signals sent through it cannot reach another process which reuses the pid
+	int pidfd = sys_pidfd_open(child_pid, 0);
+	if (pidfd == -1) {
+		syslog(LOG_ERR, "[parent] pidfd_open");
+		exit(EXIT_FAILURE);
+	}
+
+	job_spawned(j, child_pid, pidfd);
+}
+
+/*
+ * circuit breaker
+ *
+ * closed: jobs are executed. when breaker_threshold percent of the last breaker_window jobs
+ * have failed, the breaker opens: jobs stay in the queue of the rule.
+ * after breaker_cooldown_ms the breaker is half open: a single probe job is executed;
+ * the breaker closes if the probe succeeds and opens again if it fails.
+ */
+
+static void breaker_half_open(struct timer * t)
+{
+	struct rule * r = t->arg;
+
+	syslog(LOG_INFO, "rule %s: circuit breaker half open", r->name);
+
+	r->breaker_state = BREAKER_HALF_OPEN;
+	r->breaker_probing = false;
+
+	dispatch_jobs();
+}
+
+static void breaker_open(struct rule * r)
+{
+	syslog(LOG_WARNING, "rule %s: circuit breaker open, jobs are held for %ld ms", r->name, r->breaker_cooldown_ms);
+
+	r->breaker_state = BREAKER_OPEN;
+	r->breaker_opened++;
+
+	r->breaker_timer.fn = breaker_half_open;
+	r->breaker_timer.arg = r;
+	timer_arm(&r->breaker_timer, now_ns() + r->breaker_cooldown_ms * NS_PER_MS);
+}
+
+// records the outcome of a job of rule r
+static void breaker_record(struct rule * r, bool failed, bool probe)
+{
+	if (r->breaker_threshold == 0)
+		return;
+
+	uint64_t window_mask = r->breaker_window == 64 ? ~0ULL : (1ULL << r->breaker_window) - 1;
+
+	r->breaker_outcomes = ((r->breaker_outcomes << 1) | failed) & window_mask;
+	if (r->breaker_samples < r->breaker_window)
+		r->breaker_samples++;
+
+	if (probe) {
+		if (failed) {
+			breaker_open(r);
+		} else {
+			syslog(LOG_INFO, "rule %s: circuit breaker closed", r->name);
+
+			r->breaker_state = BREAKER_CLOSED;
+			r->breaker_outcomes = 0;
+			r->breaker_samples = 0;
+		}
+	} else if (r->breaker_state == BREAKER_CLOSED && r->breaker_samples == r->breaker_window
+			&& breaker_failure_percent(r) >= r->breaker_threshold) {
+		breaker_open(r);
+	}
+}
+
+// job j has failed before its handler has run: a failed probe opens the breaker again,
+// otherwise the rule would wait for the outcome of the probe for ever
+static void job_failed_early(struct job * j, const char * reason)
+{
+	breaker_record(j->rule, true, j->probe);
+	j->probe = false;
+
+	job_failed(j, reason);
+}
+
+// returns the next job of rule r which may be executed now
+static struct job * rule_next_job(struct rule * r)
+{
+	struct job * j;
+
+	switch (r->breaker_state) {
+	case BREAKER_OPEN:
+		return NULL;
+	case BREAKER_HALF_OPEN:
+		if (r->breaker_probing)
+			return NULL;
+
+		j = job_dequeue(r);
+		if (j != NULL) {
+			j->probe = true;
+			r->breaker_probing = true;
+		}
+		return j;
+	default:
+		return job_dequeue(r);
+	}
+}
+
+static void dispatch_checksums(void);
+static void dispatch_batches(void);
+
+// starts queued jobs while there are free handler slots, taking one job from each rule in turn
+static void dispatch_jobs(void)
+{
+	dispatch_checksums();
+	dispatch_batches();
+
+	while (jobs_queued > 0 && jobs_running < concurrency_limit) {
+		struct job * j = NULL;
+
+		// jobs of plugin rules are left to dispatch_batches()
+		for (int n = 0; n < rules_len && j == NULL; n++) {
+			if (rules[dispatch_next_rule]->plugin_ops == NULL)
+				j = rule_next_job(rules[dispatch_next_rule]);
+			dispatch_next_rule = (dispatch_next_rule + 1) % rules_len;
+		}
+
+		if (j == NULL)
+			break;
+
+		start_job(j);
+	}
+
+	if (jobs_queued > 0) {
+		aimd.saturated = true;
+
+		if (prefetch_budget > 0)
+			prefetch_jobs();
+	}
+}
+
+// the handler has not terminated within the rule timeout: SIGTERM, then SIGKILL after the grace period
+static void job_timeout(struct timer * t)
+{
+	struct job * j = t->arg;
+
+	if (!j->term_sent) {
+		syslog(LOG_WARNING, "[parent] timeout, sending SIGTERM to pid=%d (%s)", j->pid, j->path);
+
+		j->term_sent = true;
+		j->rule->jobs_timed_out++;
+		stats.jobs_timed_out++;
+
+		if (sys_pidfd_send_signal(j->pidfd, SIGTERM, NULL, 0) == -1)
+			syslog(LOG_ERR, "[parent] pidfd_send_signal");
+
+		// the processes started by sh -c, which are not reaped with it; the group cannot have
+		// been taken by another process as long as the handler is not reaped
+		kill(-j->pid, SIGTERM);
+
+		timer_arm(t, now_ns() + j->rule->kill_grace_ms * NS_PER_MS);
+	} else {
+		syslog(LOG_WARNING, "[parent] timeout, sending SIGKILL to pid=%d (%s)", j->pid, j->path);
+
+		j->rule->jobs_killed++;
+		stats.jobs_killed++;
+
+		if (sys_pidfd_send_signal(j->pidfd, SIGKILL, NULL, 0) == -1)
+			syslog(LOG_ERR, "[parent] pidfd_send_signal");
+
+		kill(-j->pid, SIGKILL);
+	}
+}
+
+// xorshift64*, used for retry jitter
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+	if (rng_state == 0)
+		rng_state = now_ns() ^ ((uint64_t) getpid() << 32);
+
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void job_retry(struct timer * t)
+{
+	struct job * j = t->arg;
+
+	jobs_retry_pending--;
+
+	j->enqueue_ns = now_ns();
+	job_submit(j);
+
+	dispatch_jobs();
+}
+
+/*
+ * dispositions
+ *
+ * when its job is over, the file is moved, linked or deleted according to the done (success)
+ * or dead_letter (failure) disposition of the rule. with durable, the directories changed by
+ * dispositions are fsync()ed on a worker thread. the fsyncs are group committed: while a sync
+ * is running, the directories changed by the following dispositions are collected, and the
+ * next sync covers all of them with a single fsync() per directory.
+ */
+
+struct dir_sync {
+	struct work work;           // first member: a struct work * is also a struct dir_sync *
+	int files;                  // dispositions made durable by this sync
+	int errors;                 // directories whose fsync() has failed
+	int fds_len;
+	int fds[];                  // directories to sync
+};
+
+// collects the directories for the next sync
+static struct dir_sync * sync_next = NULL;
+static bool sync_running = false;
+
+// worker thread
+static void dir_sync_run(struct work * w)
+{
+	struct dir_sync * ds = (struct dir_sync *) w;
+
+	for (int i = 0; i < ds->fds_len; i++) {
+		if (fsync(ds->fds[i]) == -1) {
+			syslog(LOG_ERR, "[worker] fsync of directory: %s", strerror(errno));
+			ds->errors++;
+		}
+	}
+}
+
+static void dir_sync_start(void)
+{
+	sync_running = true;
+
+	work_submit(&sync_next->work);
+	sync_next = NULL;
+}
+
+static void dir_sync_done(struct work * w)
+{
+	struct dir_sync * ds = (struct dir_sync *) w;
+
+	stats.dir_syncs += ds->fds_len;
+	stats.dir_sync_files += ds->files;
+	stats.dir_sync_errors += ds->errors;
+
+	free(ds);
+	sync_running = false;
+
+	if (sync_next != NULL)
+		dir_sync_start();
+}
+
+// directories fd1 and fd2 (-1 = none) have been changed by a durable disposition
+static void dir_sync_add(int fd1, int fd2)
+{
+	if (sync_next == NULL) {
+		// at most one directory per watched directory, done and dead letter directory
+		int max_fds = watched_dirs_len + 2 * rules_len;
+
+		sync_next = calloc(1, sizeof(struct dir_sync) + max_fds * sizeof(int));
+		if (sync_next == NULL) {
+			syslog(LOG_ERR, "cannot allocate directory sync");
+			exit(EXIT_FAILURE);
+		}
+
+		sync_next->work.fn = dir_sync_run;
+		sync_next->work.done = dir_sync_done;
+	}
+
+	int fds[2] = { fd1, fd2 };
+
+	for (int k = 0; k < 2; k++) {
+		int i = 0;
+
+		while (i < sync_next->fds_len && sync_next->fds[i] != fds[k])
+			i++;
+
+		if (fds[k] != -1 && i == sync_next->fds_len)
+			sync_next->fds[sync_next->fds_len++] = fds[k];
+	}
+
+	sync_next->files++;
+
+	if (!sync_running)
+		dir_sync_start();
+}
+
+// applies disposition d to the file of job j; returns false if it has failed
+static bool job_dispose(struct job * j, const struct disposition * d)
+{
+	const char * name = strrchr(j->path, '/') + 1;
+	char unique_name[NAME_MAX + 32];
+	int res;
+
+	if (d->mode == DISPOSE_DELETE) {
+		res = unlink(j->path);
+	} else {
+		// a file with the same name is never replaced: the second one gets a unique suffix
+		for (int n = 0; n < 2; n++) {
+			if (d->mode == DISPOSE_LINK)
+				res = linkat(AT_FDCWD, j->path, d->fd, name, 0);
+			else
+				res = renameat2(AT_FDCWD, j->path, d->fd, name, RENAME_NOREPLACE);
+
+			if (res == 0 || errno != EEXIST)
+				break;
+
+			snprintf(unique_name, sizeof(unique_name), "%.*s.%llu", NAME_MAX, name, (unsigned long long) now_ns());
+			name = unique_name;
+		}
+	}
+
+	if (res == -1) {
+		syslog(LOG_ERR, "[parent] cannot %s %s%s%s%s: %s", dispositions[d->mode], j->path,
+				d->dir != NULL ? " to " : "", d->dir != NULL ? d->dir : "", d->dir != NULL ? "/" : "", strerror(errno));
+		return false;
+	}
+
+	if (d->mode == DISPOSE_DELETE)
+		syslog(LOG_INFO, "[parent] delete: %s", j->path);
+	else
+		syslog(LOG_INFO, "[parent] %s: %s -> %s/%s", dispositions[d->mode], j->path, d->dir, name);
+
+	// a link does not change the source directory, a deletion has no destination;
+	// the parent directory of watched files is not synced
+	if (j->rule->durable)
+		dir_sync_add(d->mode == DISPOSE_LINK ? -1 : dir_fds[j->dir_pos], d->fd);
+
+	return true;
+}
+
+/*
+ * page cache eviction
+ *
+ * files ingested through filemon are usually read once: with evict, their pages are dropped
+ * from the page cache (POSIX_FADV_DONTNEED) when their job has succeeded, so that bulk ingest
+ * does not evict the hot data of other workloads. DONTNEED skips dirty pages and pages under
+ * writeback, common for files written just before their event: when cachestat() reports some,
+ * they are written back first. this runs on a worker thread.
+ */
+
+struct evict {
+	struct work work;           // first member: a struct work * is also a struct evict *
+	struct rule * rule;
+	int fd;
+	int64_t evicted;            // bytes dropped from the page cache
+	bool written_back;          // the file had dirty pages, written back before DONTNEED
+};
+
+// worker thread
+static void evict_run(struct work * w)
+{
+	struct evict * e = (struct evict *) w;
+	struct cache_range range = { .off = 0, .len = 0 };  // len 0: up to the end of the file
+	struct cache_stat cs;
+	struct stat st;
+
+	if (fstat(e->fd, &st) == -1)
+		return;
+
+	int64_t before = file_cached_bytes(e->fd, st.st_size);
+
+	if (before == 0)
+		return;
+
+	// without cachestat() the pages may be dirty: write them back anyway
+	bool dirty = syscall(SYS_cachestat, e->fd, &range, &cs, 0) == -1 || cs.nr_dirty + cs.nr_writeback > 0;
+
+	if (dirty && sync_file_range(e->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+			| SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+		e->written_back = true;
+
+	if (posix_fadvise(e->fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+		return;
+
+	int64_t after = file_cached_bytes(e->fd, st.st_size);
+
+	if (before > 0 && after >= 0 && after < before)
+		e->evicted = before - after;
+}
+
+static void evict_done(struct work * w)
+{
+	struct evict * e = (struct evict *) w;
+
+	e->rule->evicted_bytes += e->evicted;
+	if (e->written_back)
+		e->rule->evict_writebacks++;
+
+	close(e->fd);
+	free(e);
+}
+
+// drops the file of job j, which has succeeded, from the page cache; called before its disposition
+static void job_evict(struct job * j)
+{
+	struct evict * e = calloc(1, sizeof(struct evict));
+
+	if (e == NULL) {
+		syslog(LOG_ERR, "cannot allocate eviction");
+		return;
+	}
+
+	// the worker needs its own descriptor: the file may be moved, and j->fd is closed by job_free()
+	e->fd = j->fd != -1 ? fcntl(j->fd, F_DUPFD_CLOEXEC, 0) : open(j->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (e->fd == -1) {
+		free(e);
+		return;
+	}
+
+	e->rule = j->rule;
+	e->work.fn = evict_run;
+	e->work.done = evict_done;
+
+	work_submit(&e->work);
+}
+
+// disposes the file of job j and the files of its group; returns the number of files disposed
+static int job_dispose_all(struct job * j, const struct disposition * d)
+{
+	int n = job_dispose(j, d) ? 1 : 0;
+
+	for (struct job * m = j->members; m != NULL; m = m->next)
+		n += job_dispose(m, d) ? 1 : 0;
+
+	return n;
+}
+
+// jobs whose handler, plugin or action has succeeded end here
+static void job_succeeded(struct job * j)
+{
+	struct rule * r = j->rule;
+
+	r->jobs_succeeded++;
+	stats.jobs_succeeded++;
+
+	// a deleted file leaves the page cache by itself
+	if (r->evict && r->done.mode != DISPOSE_DELETE) {
+		job_evict(j);
+		for (struct job * m = j->members; m != NULL; m = m->next)
+			job_evict(m);
+	}
+
+	if (r->done.mode != DISPOSE_KEEP) {
+		int n = job_dispose_all(j, &r->done);
+
+		r->files_done += n;
+		stats.files_done += n;
+	}
+
+	job_free(j);
+}
+
+// failed jobs (non-zero exit status, killed by a signal, timed out) end here:
+// they are scheduled for a retry, or moved to the dead letter directory after the last attempt
+static void job_failed(struct job * j, const char * reason)
+{
+	struct rule * r = j->rule;
+
+	if (j->attempt <= r->retries) {
+		// exponential backoff with "equal jitter": half of the delay is fixed, half is random
+		uint64_t delay_ms = r->retry_delay_ms;
+
+		for (int i = 1; i < j->attempt && delay_ms < (uint64_t) r->retry_max_delay_ms; i++)
+			delay_ms *= 2;
+		if (delay_ms > (uint64_t) r->retry_max_delay_ms)
+			delay_ms = r->retry_max_delay_ms;
+
+		uint64_t delay_ns = delay_ms * NS_PER_MS / 2;
+		delay_ns += delay_ns > 0 ? rng_next() % delay_ns : 0;
+
+		syslog(LOG_WARNING, "[parent] job failed (%s), attempt %d of %d, retry in %llu ms: %s",
+				reason, j->attempt, r->retries + 1, (unsigned long long) (delay_ns / NS_PER_MS), j->path);
+
+		j->attempt++;
+		j->timer.fn = job_retry;
+		j->timer.arg = j;
+		timer_arm(&j->timer, now_ns() + delay_ns);
+		rename_job_add(j);
+
+		jobs_retry_pending++;
+		r->jobs_retried++;
+		stats.jobs_retried++;
+		return;
+	}
+
+	syslog(LOG_WARNING, "[parent] job failed (%s): %s", reason, j->path);
+
+	r->jobs_failed++;
+	stats.jobs_failed++;
+
+	if (r->dead_letter.mode != DISPOSE_KEEP && job_dispose_all(j, &r->dead_letter) > 0) {
+		r->jobs_dead_lettered++;
+		stats.jobs_dead_lettered++;
+	}
+
+	job_free(j);
+}
+
+static void job_finished(struct job * j, int wstatus, const struct rusage * ru)
+{
+	uint64_t run_ns = now_ns() - j->start_ns;
+	int modal_result = -1;
+
+	timer_cancel(&j->timer);
+
+	close(j->pidfd);
+	j->pidfd = -1;
+
+	job_output_close(j);
+	job_stdin_close(j);
+
+	if (WIFEXITED(wstatus)) {
+
+		modal_result = WEXITSTATUS(wstatus);
+
+		syslog(LOG_DEBUG, "[parent] child process has terminated, returning: %d", modal_result);
+	} else if (WIFSIGNALED(wstatus)) {
+		syslog(LOG_DEBUG, "[parent] child process killed by signal %d", WTERMSIG(wstatus));
+	}
+
+	stats.job_run_ns += run_ns;
+
+	usage_add(&j->rule->usage, ru);
+	usage_add(&dir_usage[j->dir_pos], ru);
+
+	// weight of the last sample: 0.2
+	double run_ms = (double) run_ns / NS_PER_MS;
+
+	if (aimd.latency_ewma_ms == 0)
+		aimd.latency_ewma_ms = run_ms;
+	else
+		aimd.latency_ewma_ms = 0.8 * aimd.latency_ewma_ms + 0.2 * run_ms;
+	aimd.latency_samples++;
+
+	breaker_record(j->rule, j->term_sent || modal_result != 0, j->probe);
+	j->probe = false;
+
+	if (j->term_sent) {
+		job_failed(j, "timeout");
+	} else if (modal_result != 0) {
+		job_failed(j, WIFSIGNALED(wstatus) ? "signal" : "exit status");
+	} else {
+		job_succeeded(j);
+	}
+}
+
+// removes job j from the running handlers
+static void job_stopped(struct job * j)
+{
+	for (int i = 0; i < jobs_running; i++) {
+		if (running[i] == j) {
+			running[i] = running[--jobs_running];
+			break;
+		}
+	}
+}
+
+// the pidfd of job j is readable: the handler has terminated
+static void reap_job(struct job * j)
+{
+	int wstatus;
+	struct rusage ru;
+
+	// the processes of a handler which has timed out and exited at SIGTERM may ignore it; the
+	// group is killed while the handler, not yet reaped, keeps its id
+	if (j->term_sent)
+		kill(-j->pid, SIGKILL);
+
+	// wait4() returns the resources used by the handler and by the processes it has waited for
+	pid_t ws = wait4(j->pid, &wstatus, WNOHANG, &ru);
+	if (ws == -1) {
+		syslog(LOG_ERR, "[parent] wait4");
+		exit(EXIT_FAILURE);
+	}
+
+	if (ws == 0)
+		return;
+
+	job_stopped(j);
+	job_finished(j, wstatus, &ru);
+}
+
+
+// reads the replies of the zygote to spawn requests
+static void zygote_receive(void)
+{
+	for (;;) {
+		struct spawn_reply reply;
+		struct iovec iov = { &reply, sizeof(reply) };
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {
+				.msg_iov = &iov, .msg_iovlen = 1,
+				.msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+		};
+
+		ssize_t n = recvmsg(zygote_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		if (n != sizeof(reply)) {
+			syslog(LOG_ERR, "[parent] zygote has terminated");
+			exit(EXIT_FAILURE);
+		}
+
+		struct job * j = (struct job *) (uintptr_t) reply.cookie;
+
+		if (reply.error != 0) {
+			syslog(LOG_ERR, "[parent] zygote cannot create handler: %s", strerror(reply.error));
+			job_stopped(j);
+			job_output_close(j);
+			job_stdin_close(j);
+			job_failed_early(j, "spawn");
+			continue;
+		}
+
+		int pidfd = -1;
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&pidfd, CMSG_DATA(cmsg), sizeof(int));
+
+		if (pidfd == -1) {
+			syslog(LOG_ERR, "[parent] no pidfd from zygote");
+			exit(EXIT_FAILURE);
+		}
+
+		job_spawned(j, reply.pid, pidfd);
+	}
+}
+
+/*
+ * plugins
+ *
+ * the jobs of a rule with a plugin are grouped in batches of up to batch_size jobs;
+ * each batch is a work item: handle_batch() of the plugin runs on a worker thread,
+ * then batch_done() records the outcome of each job as job_finished() does for handlers.
+ * at most 2 batches per worker thread are pending, the other jobs wait in the queue of their rule.
+ */
+
+struct batch {
+	struct work work;           // first member: a struct work * is also a struct batch *
+	struct batch * next_free;
+	struct rule * rule;         // NULL for checksum batches, whose jobs may belong to different rules
+	uint64_t run_ns;            // time spent in handle_batch()
+	size_t len;
+	struct job * jobs[BATCH_MAX];
+	struct filemon_event events[BATCH_MAX];
+	int status[BATCH_MAX];
+};
+
+static struct batch * batch_free_list = NULL;
+
+// rule which is looked at first for the next batch
+static int batch_next_rule = 0;
+
+static struct batch * batch_alloc(void)
+{
+	struct batch * b = batch_free_list;
+
+	if (b != NULL) {
+		batch_free_list = b->next_free;
+	} else {
+		b = malloc(sizeof(struct batch));
+		if (b == NULL) {
+			syslog(LOG_ERR, "cannot allocate batch");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	b->len = 0;
+
+	return b;
+}
+
+static void batch_free(struct batch * b)
+{
+	b->next_free = batch_free_list;
+	batch_free_list = b;
+}
+
+// worker thread
+static void batch_run(struct work * w)
+{
+	struct batch * b = (struct batch *) w;
+	uint64_t start = now_ns();
+
+	b->rule->plugin_ops->handle_batch(b->rule->plugin_state, b->events, b->len, b->status);
+
+	b->run_ns = now_ns() - start;
+}
+
+static void batch_done(struct work * w)
+{
+	struct batch * b = (struct batch *) w;
+	struct rule * r = b->rule;
+
+	r->batches++;
+	stats.batches++;
+
+	for (size_t i = 0; i < b->len; i++) {
+		struct job * j = b->jobs[i];
+
+		stats.job_run_ns += b->run_ns / b->len;
+
+		breaker_record(r, b->status[i] != 0, j->probe);
+		j->probe = false;
+
+		if (b->status[i] != 0) {
+			job_failed(j, "plugin");
+		} else {
+			job_succeeded(j);
+		}
+	}
+
+	batch_free(b);
+}
+
+// takes up to batch_size jobs of rule r; returns NULL if no job may be executed now
+static struct batch * batch_build(struct rule * r)
+{
+	struct job * j = rule_next_job(r);
+
+	if (j == NULL)
+		return NULL;
+
+	struct batch * b = batch_alloc();
+
+	b->work.fn = batch_run;
+	b->work.done = batch_done;
+	b->rule = r;
+
+	uint64_t now = now_ns();
+
+	do {
+		struct filemon_event * e = &b->events[b->len];
+
+		j->start_ns = now;
+
+		e->path = j->path;
+		e->dir = watched_dirs[j->dir_pos];
+		e->name = strrchr(j->path, '/') + 1;
+		e->mask = j->mask;
+		e->fd = j->fd;
+		e->event_ts_ns = j->event_ts_ns;
+		e->queue_wait_ns = now - j->enqueue_ns;
+		e->attempt = j->attempt;
+		e->checksum = j->checksum[0] != 0 ? j->checksum : NULL;
+
+		b->status[b->len] = 0;
+		b->jobs[b->len++] = j;
+
+		stats.jobs_started++;
+		stats.job_wait_ns += now - j->enqueue_ns;
+	} while (b->len < (size_t) r->batch_size && (j = rule_next_job(r)) != NULL);
+
+	return b;
+}
+
+// submits batches of the rules with a plugin, one batch of each rule in turn
+static void dispatch_batches(void)
+{
+	int idle_rules = 0;
+
+	while (workers_started > 0 && jobs_queued > 0 && work_pending < 2 * workers && idle_rules < rules_len) {
+		struct rule * r = rules[batch_next_rule];
+		struct batch * b = r->plugin_ops != NULL ? batch_build(r) : NULL;
+
+		batch_next_rule = (batch_next_rule + 1) % rules_len;
+
+		if (b == NULL) {
+			idle_rules++;
+			continue;
+		}
+
+		idle_rules = 0;
+		work_submit(&b->work);
+	}
+}
+
+// waits for the pending batches, then calls the shutdown function of the plugins
+static void plugins_shutdown(void)
+{
+	workers_stop();
+
+	for (int i = 0; i < rules_len; i++) {
+		struct rule * r = rules[i];
+
+		if (r->plugin_ops != NULL && r->plugin_ops->shutdown != NULL)
+			r->plugin_ops->shutdown(r->plugin_state);
+	}
+}
+
+/*
+ * built-in actions
+ *
+ * actions executed by filemon itself, without starting a process: they are implemented with
+ * the plugin interface and run on the worker threads.
+ */
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// temporary name in the destination directory, unique among worker threads
+static void copy_tmp_name(char * buf, size_t size, const char * name)
+{
+	snprintf(buf, size, ".%.200s.filemon-%ld", name, (long) syscall(SYS_gettid));
+}
+
+// copies the data of src to dst; returns 0 or an errno value
+static int copy_data(struct rule * r, int src, int dst)
+{
+	// reflink: the copy shares the blocks of the source, nothing is copied until either one is modified
+	if (ioctl(dst, FICLONE, src) == 0) {
+		struct stat st;
+
+		if (fstat(dst, &st) == 0)
+			__atomic_add_fetch(&r->copy_bytes, st.st_size, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&r->copy_reflinks, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// explicit offsets: the offset of a descriptor passed with pass-fd is not changed
+	loff_t in_off = 0;
+	loff_t out_off = 0;
+	bool use_sendfile = false;
+
+	// the whole file is copied, even if it has grown since the event
+	for (;;) {
+		ssize_t n;
+
+		if (!use_sendfile) {
+			// copy inside the kernel, or offloaded to the file system (e.g. NFS server side copy)
+			n = copy_file_range(src, &in_off, dst, &out_off, 1 << 30, 0);
+
+			// copy_file_range() fails between different file systems before Linux 5.3
+			if (n == -1 && in_off == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				use_sendfile = true;
+				continue;
+			}
+		} else {
+			n = sendfile(dst, src, &in_off, 1 << 30);
+		}
+
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		if (n == -1)
+			return errno;
+
+		if (n == 0)
+			return 0;
+
+		__atomic_add_fetch(&r->copy_bytes, n, __ATOMIC_RELAXED);
+	}
+}
+
+// names the complete copy dst: name in copy_to, replacing an older copy with the same name
+static int copy_publish(struct rule * r, int dst, const char * tmp_name, const char * name)
+{
+	char proc_path[32];
+	char link_name[NAME_MAX + 1];
+
+	// no O_TMPFILE: dst is tmp_name
+	if (tmp_name[0] != 0)
+		return renameat(r->copy_to_fd, tmp_name, r->copy_to_fd, name) == -1 ? errno : 0;
+
+	// linkat() with AT_EMPTY_PATH requires CAP_DAC_READ_SEARCH, the /proc link does not
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dst);
+
+	if (linkat(AT_FDCWD, proc_path, r->copy_to_fd, name, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
+
+	if (errno != EEXIST)
+		return errno;
+
+	// linkat() does not replace an existing name: link to a temporary name, then rename
+	copy_tmp_name(link_name, sizeof(link_name), name);
+
+	if (linkat(AT_FDCWD, proc_path, r->copy_to_fd, link_name, AT_SYMLINK_FOLLOW) == -1)
+		return errno;
+
+	if (renameat(r->copy_to_fd, link_name, r->copy_to_fd, name) == -1) {
+		int err = errno;
+
+		unlinkat(r->copy_to_fd, link_name, 0);
+		return err;
+	}
+
+	return 0;
+}
+
+// copies the file of event e to copy_to; the copy appears complete, with mode and mtime of the file, or not at all.
+// returns 0 or an errno value
+static int copy_file(struct rule * r, const struct filemon_event * e)
+{
+	char tmp_name[NAME_MAX + 1] = "";
+	struct stat st;
+	int src = e->fd;
+	int dst = -1;
+	int err = 0;
+
+	if (src == -1) {
+		src = open(e->path, O_RDONLY | O_CLOEXEC);
+		if (src == -1)
+			return errno;
+	}
+
+	if (fstat(src, &st) == -1) {
+		err = errno;
+		goto out;
+	}
+
+	// O_TMPFILE: the copy has no name until it is complete
+	dst = openat(r->copy_to_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+
+	if (dst == -1 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+		copy_tmp_name(tmp_name, sizeof(tmp_name), e->name);
+		dst = openat(r->copy_to_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	}
+
+	if (dst == -1) {
+		err = errno;
+		goto out;
+	}
+
+	err = copy_data(r, src, dst);
+	if (err != 0)
+		goto out;
+
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+	if (fchmod(dst, st.st_mode & 07777) == -1 || futimens(dst, times) == -1) {
+		err = errno;
+		goto out;
+	}
+
+	err = copy_publish(r, dst, tmp_name, e->name);
+
+out:
+	if (err != 0 && tmp_name[0] != 0 && dst != -1)
+		unlinkat(r->copy_to_fd, tmp_name, 0);
+
+	if (dst != -1)
+		close(dst);
+
+	if (src != e->fd)
+		close(src);
+
+	return err;
+}
+
+static void copy_handle_batch(void * state, const struct filemon_event * events, size_t n, int * status)
+{
+	struct rule * r = state;
+
+	for (size_t i = 0; i < n; i++) {
+		status[i] = copy_file(r, &events[i]);
+
+		if (status[i] != 0)
+			syslog(LOG_ERR, "[worker] cannot copy %s to %s: %s", events[i].path, r->copy_to, strerror(status[i]));
+	}
+}
+
+static const struct filemon_plugin copy_action = {
+		.abi_version = FILEMON_PLUGIN_ABI_VERSION,
+		.name = "copy",
+		.handle_batch = copy_handle_batch,
+};
+
+// sets up the built-in action of rule r
+static void action_open(struct rule * r)
+{
+	switch (r->action) {
+	case ACTION_COPY:
+		if (r->copy_to == NULL) {
+			syslog(LOG_ERR, "rule %s: the copy action requires copy-to", r->name);
+			exit(EXIT_FAILURE);
+		}
+
+		r->copy_to_fd = open(r->copy_to, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (r->copy_to_fd == -1) {
+			syslog(LOG_ERR, "rule %s: cannot open copy-to directory %s", r->name, r->copy_to);
+			exit(EXIT_FAILURE);
+		}
+
+		r->plugin_ops = &copy_action;
+		r->plugin_state = r;
+		break;
+	case ACTION_CHECKSUM:
+		if (r->checksum == CHECKSUM_NONE)
+			r->checksum = CHECKSUM_SHA256;
+
+		if (r->checksum_dir == NULL) {
+			syslog(LOG_ERR, "rule %s: the checksum action requires checksum-dir", r->name);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	}
+}
+
+
+/*
+ * checksums
+ *
+ * with the rule checksum setting, the checksum of each file is computed on the worker threads
+ * before the action of the rule: commands find it in FILEMON_CHECKSUM, plugins in the checksum
+ * field of struct filemon_event. with checksum-dir, a sidecar file NAME.ALGORITHM is written too.
+ * CRC32C uses the crc32 instructions of SSE4.2 or ARMv8, SHA-256 the SHA extensions of x86 CPUs,
+ * when the CPU has them; otherwise portable implementations are used.
+ */
+
+#define CHECKSUM_CHUNK (1 << 20)
+
+// jobs per checksum batch: few, so that large files are spread over the worker threads
+#define CHECKSUM_BATCH 8
+
+struct checksum_ctx {
+	int alg;
+	uint64_t total_len;
+	uint32_t crc;               // crc32c
+	uint64_t xxh_v[4];          // xxh64
+	uint32_t sha_h[8];          // sha256
+	uint8_t buf[64];            // partial block: 32 bytes for xxh64, 64 bytes for sha256
+	size_t buf_len;
+};
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t * p, size_t len)
+{
+	while (len-- > 0)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+// 8 bytes per crc32 instruction: about 8 bytes every 3 cycles
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t * p, size_t len)
+{
+	uint64_t c = crc;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+
+	crc = c;
+	for (; len > 0; p++, len--)
+		crc = __builtin_ia32_crc32qi(crc, *p);
+
+	return crc;
+}
+
+#elif defined(__aarch64__)
+
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t * p, size_t len)
+{
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+
+	for (; len > 0; p++, len--)
+		crc = __crc32cb(crc, *p);
+
+	return crc;
+}
+
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t * p, size_t len) = crc32c_generic;
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int n)
+{
+	return (x << n) | (x >> (64 - n));
+}
+
+static inline uint64_t read64le(const uint8_t * p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+	return (acc ^ xxh64_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+// processes len / 32 stripes of p; returns the number of bytes processed
+static size_t xxh64_stripes(uint64_t v[4], const uint8_t * p, size_t len)
+{
+	size_t done = 0;
+
+	for (; len - done >= 32; done += 32) {
+		v[0] = xxh64_round(v[0], read64le(p + done));
+		v[1] = xxh64_round(v[1], read64le(p + done + 8));
+		v[2] = xxh64_round(v[2], read64le(p + done + 16));
+		v[3] = xxh64_round(v[3], read64le(p + done + 24));
+	}
+
+	return done;
+}
+
+static uint64_t xxh64_final(const struct checksum_ctx * c)
+{
+	const uint8_t * p = c->buf;
+	size_t len = c->buf_len;
+	uint64_t h;
+
+	if (c->total_len >= 32) {
+		h = rotl64(c->xxh_v[0], 1) + rotl64(c->xxh_v[1], 7) + rotl64(c->xxh_v[2], 12) + rotl64(c->xxh_v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = xxh64_merge(h, c->xxh_v[i]);
+	} else {
+		h = XXH_P5;             // seed 0
+	}
+
+	h += c->total_len;
+
+	for (; len >= 8; p += 8, len -= 8)
+		h = rotl64(h ^ xxh64_round(0, read64le(p)), 27) * XXH_P1 + XXH_P4;
+
+	if (len >= 4) {
+		uint32_t v;
+
+		memcpy(&v, p, sizeof(v));
+		h = rotl64(h ^ (uint64_t) le32toh(v) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		len -= 4;
+	}
+
+	for (; len > 0; p++, len--)
+		h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static const uint32_t sha256_k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_generic(uint32_t h[8], const uint8_t * p, size_t blocks)
+{
+	for (; blocks > 0; blocks--, p += 64) {
+		uint32_t w[64];
+
+		for (int i = 0; i < 16; i++) {
+			memcpy(&w[i], p + 4 * i, sizeof(uint32_t));
+			w[i] = be32toh(w[i]);
+		}
+
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+
+		for (int i = 0; i < 64; i++) {
+			uint32_t t1 = hh + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+	}
+}
+
+#if defined(__x86_64__)
+
+// SHA extensions: each sha256rnds2 instruction computes 2 rounds
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t h[8], const uint8_t * p, size_t blocks)
+{
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_loadu_si128((const __m128i *) &h[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i *) &h[4]);
+	__m128i state0;
+
+	// the instructions take the state as ABEF and CDGH
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);
+	state1 = _mm_shuffle_epi32(state1, 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	for (; blocks > 0; blocks--, p += 64) {
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+		__m128i w[4];           // message schedule, 4 words per round group
+
+		for (int i = 0; i < 16; i++) {
+			__m128i msg;
+
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), byte_swap);
+			} else {
+				// w[i] = sigma1(w[i - 2]) + w[i - 7] + sigma0(w[i - 15]) + w[i - 16]
+				msg = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+				msg = _mm_add_epi32(msg, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+				w[i % 4] = _mm_sha256msg2_epu32(msg, w[(i + 3) % 4]);
+			}
+
+			msg = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *) &h[0], state0);
+	_mm_storeu_si128((__m128i *) &h[4], state1);
+}
+
+#endif
+
+static void (*sha256_blocks)(uint32_t h[8], const uint8_t * p, size_t blocks) = sha256_blocks_generic;
+
+// selects the implementations supported by the CPU; called once, before the worker threads start
+static void checksum_cpu_init(void)
+{
+	static bool done = false;
+	const char * crc_impl = "generic";
+	const char * sha_impl = "generic";
+
+	if (done)
+		return;
+	done = true;
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+		crc32c_update = crc32c_hw;
+		crc_impl = "sse4.2";
+
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+			sha256_blocks = sha256_blocks_shani;
+			sha_impl = "sha-ni";
+		}
+	}
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32c_update = crc32c_hw;
+		crc_impl = "armv8-crc";
+	}
+#endif
+
+	syslog(LOG_INFO, "checksums: crc32c %s, sha256 %s", crc_impl, sha_impl);
+}
+
+static void checksum_init(struct checksum_ctx * c, int alg)
+{
+	static const uint32_t sha256_h0[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	c->alg = alg;
+	c->total_len = 0;
+	c->buf_len = 0;
+	c->crc = ~0U;
+
+	c->xxh_v[0] = XXH_P1 + XXH_P2;
+	c->xxh_v[1] = XXH_P2;
+	c->xxh_v[2] = 0;
+	c->xxh_v[3] = -XXH_P1;
+
+	memcpy(c->sha_h, sha256_h0, sizeof(sha256_h0));
+}
+
+static void checksum_update(struct checksum_ctx * c, const uint8_t * p, size_t len)
+{
+	size_t block = c->alg == CHECKSUM_XXH64 ? 32 : 64;
+
+	c->total_len += len;
+
+	if (c->alg == CHECKSUM_CRC32C) {
+		c->crc = crc32c_update(c->crc, p, len);
+		return;
+	}
+
+	// complete the partial block, then process whole blocks directly from p
+	if (c->buf_len > 0) {
+		size_t n = block - c->buf_len < len ? block - c->buf_len : len;
+
+		memcpy(c->buf + c->buf_len, p, n);
+		c->buf_len += n;
+		p += n;
+		len -= n;
+
+		if (c->buf_len < block)
+			return;
+
+		if (c->alg == CHECKSUM_XXH64)
+			xxh64_stripes(c->xxh_v, c->buf, block);
+		else
+			sha256_blocks(c->sha_h, c->buf, 1);
+		c->buf_len = 0;
+	}
+
+	size_t done;
+
+	if (c->alg == CHECKSUM_XXH64) {
+		done = xxh64_stripes(c->xxh_v, p, len);
+	} else {
+		done = len / 64 * 64;
+		sha256_blocks(c->sha_h, p, len / 64);
+	}
+
+	memcpy(c->buf, p + done, len - done);
+	c->buf_len = len - done;
+}
+
+// writes the checksum as hexadecimal digits to hex (at least 65 bytes)
+static void checksum_final(struct checksum_ctx * c, char * hex)
+{
+	switch (c->alg) {
+	case CHECKSUM_CRC32C:
+		sprintf(hex, "%08x", ~c->crc);
+		break;
+	case CHECKSUM_XXH64:
+		sprintf(hex, "%016llx", (unsigned long long) xxh64_final(c));
+		break;
+	case CHECKSUM_SHA256: {
+		uint64_t bits = htobe64(c->total_len * 8);
+		uint8_t pad[128] = { 0x80 };
+		size_t pad_len = (c->buf_len < 56 ? 56 : 120) - c->buf_len;
+
+		memcpy(pad + pad_len, &bits, sizeof(bits));
+		checksum_update(c, pad, pad_len + sizeof(bits));
+
+		for (int i = 0; i < 8; i++)
+			sprintf(hex + 8 * i, "%08x", c->sha_h[i]);
+		break;
+	}
+	}
+}
+
+// writes the sidecar file NAME.ALGORITHM of job j to checksum_dir, in the format of sha256sum
+static int checksum_sidecar(struct job * j, const char * hex)
+{
+	struct rule * r = j->rule;
+	const char * name = strrchr(j->path, '/') + 1;
+	char sidecar[NAME_MAX + 16];
+	char tmp_name[NAME_MAX + 1];
+	char line[NAME_MAX + 80];
+	int err = 0;
+
+	snprintf(sidecar, sizeof(sidecar), "%s.%s", name, checksums[r->checksum]);
+	copy_tmp_name(tmp_name, sizeof(tmp_name), sidecar);
+
+	int len = snprintf(line, sizeof(line), "%s  %s\n", hex, name);
+	int fd = openat(r->checksum_dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd == -1)
+		return errno;
+
+	if (write(fd, line, len) != len)
+		err = errno != 0 ? errno : EIO;
+
+	if (close(fd) == -1 && err == 0)
+		err = errno;
+
+	if (err == 0 && renameat(r->checksum_dir_fd, tmp_name, r->checksum_dir_fd, sidecar) == -1)
+		err = errno;
+
+	if (err != 0)
+		unlinkat(r->checksum_dir_fd, tmp_name, 0);
+
+	return err;
+}
+
+// computes the checksum of the file of job j into j->checksum; returns 0 or an errno value
+static int checksum_file(struct job * j)
+{
+	// one buffer per worker thread
+	static __thread uint8_t * chunk = NULL;
+	struct rule * r = j->rule;
+	struct checksum_ctx c;
+	char hex[65];
+	int fd = j->fd;
+	int err = 0;
+
+	if (chunk == NULL && (chunk = malloc(CHECKSUM_CHUNK)) == NULL)
+		return ENOMEM;
+
+	if (fd == -1) {
+		fd = open(j->path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return errno;
+	}
+
+	// larger readahead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	checksum_init(&c, r->checksum);
+
+	// pread(): the offset of a descriptor passed with pass-fd is not changed
+	for (off_t off = 0;;) {
+		ssize_t n = pread(fd, chunk, CHECKSUM_CHUNK, off);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		if (n == -1) {
+			err = errno;
+			break;
+		}
+
+		if (n == 0)
+			break;
+
+		checksum_update(&c, chunk, n);
+		off += n;
+		__atomic_add_fetch(&r->checksum_bytes, n, __ATOMIC_RELAXED);
+	}
+
+	if (fd != j->fd)
+		close(fd);
+
+	if (err != 0)
+		return err;
+
+	checksum_final(&c, hex);
+
+	if (r->checksum_dir_fd != -1 && (err = checksum_sidecar(j, hex)) != 0)
+		return err;
+
+	snprintf(j->checksum, sizeof(j->checksum), "%s:%s", checksums[r->checksum], hex);
+
+	return 0;
+}
+
+// worker thread
+static void checksum_batch_run(struct work * w)
+{
+	struct batch * b = (struct batch *) w;
+
+	for (size_t i = 0; i < b->len; i++)
+		b->status[i] = checksum_file(b->jobs[i]);
+}
+
+static void checksum_batch_done(struct work * w)
+{
+	struct batch * b = (struct batch *) w;
+
+	for (size_t i = 0; i < b->len; i++) {
+		struct job * j = b->jobs[i];
+		struct rule * r = j->rule;
+
+		if (b->status[i] != 0) {
+			syslog(LOG_ERR, "cannot compute checksum of %s: %s", j->path, strerror(b->status[i]));
+			job_failed_early(j, "checksum");
+			continue;
+		}
+
+		syslog(LOG_INFO, "%s %s", j->checksum, j->path);
+
+		// the checksum action ends here, the other ones go on
+		if (r->action == ACTION_CHECKSUM)
+			job_succeeded(j);
+		else
+			job_enqueue(j);
+	}
+
+	batch_free(b);
+}
+
+// submits batches of the jobs waiting for the checksum stage
+static void dispatch_checksums(void)
+{
+	while (workers_started > 0 && checksum_queued > 0 && work_pending < 2 * workers) {
+		struct batch * b = batch_alloc();
+
+		b->work.fn = checksum_batch_run;
+		b->work.done = checksum_batch_done;
+		b->rule = NULL;
+
+		while (b->len < CHECKSUM_BATCH && checksum_queued > 0) {
+			struct job * j = checksum_dequeue();
+
+			if (j->renamed_away) {
+				job_free(j);
+				continue;
+			}
+
+			rename_job_del(j);
+			b->jobs[b->len++] = j;
+		}
+
+		if (b->len == 0) {
+			batch_free(b);
+			break;
+		}
+
+		work_submit(&b->work);
+	}
+}
+
+static void checksum_open(struct rule * r)
+{
+	checksum_cpu_init();
+
+	if (r->checksum_dir != NULL) {
+		r->checksum_dir_fd = open(r->checksum_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (r->checksum_dir_fd == -1) {
+			syslog(LOG_ERR, "rule %s: cannot open checksum directory %s", r->name, r->checksum_dir);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+/*
+ * content types
+ *
+ * rules with content_types take only files whose content is of one of those types, so that a
+ * single rules file routes gzip, parquet or csv files to different commands without a file(1) or
+ * a header check in each command. the type is guessed from the first SNIFF_LEN bytes of the
+ * file: a pread() done once per event, and only if a rule with content_types matches the name.
+ * binary formats are recognized by their magic bytes, looked up by first byte in a table
+ * compiled at startup; the other files are text (json, xml, csv by a delimiter heuristic) or
+ * binary.
+ */
+
+#define SNIFF_LEN 4096
+
+struct content_sig {
+	int type;
+	unsigned char len;
+	const char * magic;
+};
+
+// magic bytes at offset 0 of the file
+static const struct content_sig content_sigs[] = {
+		{ CONTENT_GZIP,    3, "\x1f\x8b\x08" },
+		{ CONTENT_ZSTD,    4, "\x28\xb5\x2f\xfd" },
+		{ CONTENT_BZIP2,   3, "BZh" },
+		{ CONTENT_XZ,      6, "\xfd" "7zXZ\0" },
+		{ CONTENT_ZIP,     4, "PK\x03\x04" },
+		{ CONTENT_ZIP,     4, "PK\x05\x06" },
+		{ CONTENT_PARQUET, 4, "PAR1" },
+		{ CONTENT_PDF,     5, "%PDF-" },
+		{ CONTENT_JPEG,    3, "\xff\xd8\xff" },
+		{ CONTENT_PNG,     8, "\x89PNG\r\n\x1a\n" },
+		{ CONTENT_GIF,     4, "GIF8" },
+		{ CONTENT_ELF,     4, "\x7f" "ELF" },
+};
+
+#define CONTENT_SIGS ((int) (sizeof(content_sigs) / sizeof(content_sigs[0])))
+
+// content_sigs by first byte: first signature, -1 if none, and the next one with the same first byte
+static int sig_first[256];
+static int sig_next[CONTENT_SIGS];
+
+static void content_sigs_compile(void)
+{
+	memset(sig_first, -1, sizeof(sig_first));
+
+	for (int i = CONTENT_SIGS - 1; i >= 0; i--) {
+		unsigned char c = content_sigs[i].magic[0];
+
+		sig_next[i] = sig_first[c];
+		sig_first[c] = i;
+	}
+}
+
+// true if b[0] .. b[n - 1], complete lines if truncated, look like a table: at least two lines,
+// each one with the same number of a delimiter outside quotes
+static bool content_csv(const unsigned char * b, size_t n, bool truncated)
+{
+	static const char delimiters[] = ",;\t|";
+
+	if (truncated) {
+		while (n > 0 && b[n - 1] != '\n')
+			n--;
+	}
+
+	for (const char * d = delimiters; *d != 0; d++) {
+		int lines = 0, fields = 0, count = 0;
+		bool quoted = false;
+
+		for (size_t i = 0; i <= n; i++) {
+			if (i < n && b[i] == '"') {
+				quoted = !quoted;
+			} else if (i < n && b[i] == (unsigned char) *d && !quoted) {
+				count++;
+			} else if ((i == n && i > 0 && b[i - 1] != '\n') || (i < n && b[i] == '\n' && !quoted)) {
+				if (count == 0 || (lines > 0 && count != fields))
+					break;
+				fields = count;
+				count = 0;
+				lines++;
+			}
+
+			if (i == n && lines >= 2)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// type of a file whose first bytes are b[0] .. b[n - 1]; truncated if the file has more bytes
+static int content_classify(const unsigned char * b, size_t n, bool truncated)
+{
+	if (n == 0)
+		return CONTENT_EMPTY;
+
+	for (int i = sig_first[b[0]]; i != -1; i = sig_next[i]) {
+		if (n >= content_sigs[i].len && memcmp(b, content_sigs[i].magic, content_sigs[i].len) == 0)
+			return content_sigs[i].type;
+	}
+
+	// text: no control characters other than spaces and escapes; bytes >= 0x80 are UTF-8
+	for (size_t i = 0; i < n; i++) {
+		if ((b[i] < 0x20 && b[i] != '\t' && b[i] != '\n' && b[i] != '\r' && b[i] != '\f' && b[i] != 0x1b) || b[i] == 0x7f)
+			return CONTENT_BINARY;
+	}
+
+	size_t i = n >= 3 && memcmp(b, "\xef\xbb\xbf", 3) == 0 ? 3 : 0;
+
+	while (i < n && isspace(b[i]))
+		i++;
+
+	if (i < n && (b[i] == '{' || b[i] == '['))
+		return CONTENT_JSON;
+	if (i < n && b[i] == '<')
+		return CONTENT_XML;
+
+	return content_csv(b, n, truncated) ? CONTENT_CSV : CONTENT_TEXT;
+}
+
+// type of file name of directory dir_fd, -1 if it cannot be read or is not a regular file
+static int content_sniff(int dir_fd, const char * name)
+{
+	unsigned char buf[SNIFF_LEN + 1];
+	struct stat st;
+	ssize_t n;
+
+	// O_NONBLOCK: a fifo does not block the main thread
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+
+	if (fd == -1)
+		return -1;
+
+	// one more byte tells whether the file is longer than SNIFF_LEN
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (n = pread(fd, buf, sizeof(buf), 0)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	int type = content_classify(buf, n > SNIFF_LEN ? SNIFF_LEN : n, n > SNIFF_LEN);
+
+	stats.content_sniffed[type]++;
+
+	return type;
+}
+
+
+/*
+ * rule matching
+ *
+ * the rules which can take the events of a watched directory (under is that directory or one of
+ * its parents) are compiled at startup into a matcher of the directory: watches are not
+ * recursive, so the directory part of the match is resolved once, not for every event.
+ * literal patterns are looked up in two tries, walked once over the name: one of exact names and
+ * prefixes (PREFIX*), one of suffixes (*SUFFIX), walked from the end of the name. the other rules
+ * (no pattern, other globs, regex) are tried in order, but only while they come before the best
+ * rule found so far. the cost of a lookup depends on the length of the name, not on the number of
+ * literal rules.
+ *
+ * rules are numbered in match order: an event is taken by the first rule whose pattern matches
+ * the name, whose events include the event (or which is a tail rule), and whose size limits
+ * accept the file. the file is stat()ed only for rules with size limits, and read only for rules
+ * with content types (see content_sniff()), at most once per event.
+ */
+
+struct trie_node {
+	int child;                  // first child, -1 if none
+	int sibling;                // next child of the same parent, -1 if none
+	int rules;                  // first entry of the rules whose literal ends here, -1 if none
+	int exact;                  // prefix trie: the same, for exact names
+	unsigned char c;
+};
+
+// rules with the same literal, in match order
+struct trie_entry {
+	int rule;                   // position in match_rules
+	int next;                   // next entry, -1 if none
+};
+
+struct trie {
+	struct trie_node * nodes;   // nodes[0] is the root
+	int len;
+	int size;
+	struct trie_entry * entries;
+	int entries_len;
+};
+
+struct matcher {
+	struct trie prefixes;       // exact names and prefixes
+	struct trie suffixes;       // suffixes, reversed
+	int * others;               // rules matched one by one, in match order
+	int others_len;
+};
+
+// rules in match order
+static struct rule ** match_rules = NULL;
+static int match_rules_len = 0;
+
+// one for each watched directory
+static struct matcher * matchers = NULL;
+
+static int trie_node_new(struct trie * t, unsigned char c)
+{
+	if (t->len == t->size) {
+		t->size = t->size > 0 ? 2 * t->size : 16;
+		t->nodes = realloc(t->nodes, sizeof(struct trie_node) * t->size);
+		if (t->nodes == NULL) {
+			syslog(LOG_ERR, "cannot allocate trie");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	t->nodes[t->len] = (struct trie_node) { .child = -1, .sibling = -1, .rules = -1, .exact = -1, .c = c };
+
+	return t->len++;
+}
+
+static inline int trie_child(const struct trie * t, int node, unsigned char c)
+{
+	for (int n = t->nodes[node].child; n != -1; n = t->nodes[n].sibling) {
+		if (t->nodes[n].c == c)
+			return n;
+	}
+
+	return -1;
+}
+
+// adds rule (position in match_rules) for literal s, read backwards if reverse
+static void trie_insert(struct trie * t, const char * s, size_t len, bool reverse, bool exact, int rule)
+{
+	int node = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = s[reverse ? len - 1 - i : i];
+		int child = trie_child(t, node, c);
+
+		if (child == -1) {
+			child = trie_node_new(t, c);
+			t->nodes[child].sibling = t->nodes[node].child;
+			t->nodes[node].child = child;
+		}
+
+		node = child;
+	}
+
+	t->entries = realloc(t->entries, sizeof(struct trie_entry) * (t->entries_len + 1));
+	if (t->entries == NULL) {
+		syslog(LOG_ERR, "cannot allocate trie");
+		exit(EXIT_FAILURE);
+	}
+
+	t->entries[t->entries_len] = (struct trie_entry) { .rule = rule, .next = -1 };
+
+	// rules are inserted in match order: append
+	int * head = exact ? &t->nodes[node].exact : &t->nodes[node].rules;
+
+	while (*head != -1)
+		head = &t->entries[*head].next;
+
+	*head = t->entries_len++;
+}
+
+// true if the files of watched directory dir can be taken by rule r
+static bool rule_under(const struct rule * r, const char * dir)
+{
+	size_t len;
+
+	if (r->under == NULL)
+		return true;
+
+	len = strlen(r->under);
+
+	if (strncmp(dir, r->under, len) != 0)
+		return false;
+
+	return dir[len] == 0 || dir[len] == '/' || r->under[len - 1] == '/';
+}
+
+// numbers the rules in match order and compiles the matchers of the watched directories
+static void rules_compile(void)
+{
+	content_sigs_compile();
+
+	match_rules = calloc(rules_len, sizeof(struct rule *));
+	matchers = calloc(watched_dirs_len, sizeof(struct matcher));
+	if (match_rules == NULL || matchers == NULL) {
+		syslog(LOG_ERR, "calloc error");
+		exit(EXIT_FAILURE);
+	}
+
+	// the rules of the rules file, then the one of the command line
+	for (int i = 0; i < rules_len; i++) {
+		if (rules[i] != default_rule)
+			match_rules[match_rules_len++] = rules[i];
+	}
+	if (default_rule != NULL)
+		match_rules[match_rules_len++] = default_rule;
+
+	for (int d = 0; d < watched_dirs_len; d++) {
+		struct matcher * m = &matchers[d];
+
+		trie_node_new(&m->prefixes, 0);
+		trie_node_new(&m->suffixes, 0);
+
+		if (watched_dirs[d] == NULL)
+			continue;
+
+		for (int i = 0; i < match_rules_len; i++) {
+			struct rule * r = match_rules[i];
+
+			if (!rule_under(r, watched_dirs[d]))
+				continue;
+
+			switch (r->match_kind) {
+			case MATCH_EXACT:
+				trie_insert(&m->prefixes, r->literal, r->literal_len, false, true, i);
+				break;
+			case MATCH_PREFIX:
+				trie_insert(&m->prefixes, r->literal, r->literal_len, false, false, i);
+				break;
+			case MATCH_SUFFIX:
+				trie_insert(&m->suffixes, r->literal, r->literal_len, true, false, i);
+				break;
+			default:
+				m->others = realloc(m->others, sizeof(int) * (m->others_len + 1));
+				if (m->others == NULL) {
+					syslog(LOG_ERR, "cannot allocate matcher");
+					exit(EXIT_FAILURE);
+				}
+				m->others[m->others_len++] = i;
+			}
+		}
+
+		syslog(LOG_INFO, "directory %s: %d trie nodes, %d rules matched one by one",
+				watched_dirs[d], m->prefixes.len + m->suffixes.len, m->others_len);
+	}
+}
+
+// an event rule_match() is looking at
+struct match_event {
+	int dir_pos;
+	const char * name;
+	uint32_t mask;
+	int stat_res;               // result of fstatat(), 1 until it is called
+	struct stat st;
+	int content_type;           // result of content_sniff(), -2 until it is called
+};
+
+// true if rule r, whose pattern matches the name, takes event e
+static bool rule_accepts(const struct rule * r, struct match_event * e)
+{
+	if (!r->tail && !(e->mask & r->events))
+		return false;
+
+	if (r->min_size > 0 || r->max_size > 0) {
+		if (e->stat_res == 1)
+			e->stat_res = fstatat(dir_fds[e->dir_pos], e->name, &e->st, 0);
+
+		if (e->stat_res == -1 || e->st.st_size < r->min_size || (r->max_size > 0 && e->st.st_size > r->max_size))
+			return false;
+	}
+
+	if (r->content_types != 0) {
+		if (e->content_type == -2)
+			e->content_type = content_sniff(dir_fds[e->dir_pos], e->name);
+
+		if (e->content_type == -1 || !(r->content_types & (1u << e->content_type)))
+			return false;
+	}
+
+	return true;
+}
+
+// the first rule in the entry list which starts at first and takes e, if it comes before best; best otherwise
+static inline int trie_entries_best(const struct trie * t, int first, int best, struct match_event * e)
+{
+	for (int n = first; n != -1 && t->entries[n].rule < best; n = t->entries[n].next) {
+		if (rule_accepts(match_rules[t->entries[n].rule], e))
+			return t->entries[n].rule;
+	}
+
+	return best;
+}
+
+// returns the rule which takes the event mask about file name of watched directory dir_pos, or NULL;
+// stores in *content_type the type of the file if it has been read, -1 otherwise
+static struct rule * rule_match(int dir_pos, const char * name, uint32_t mask, int * content_type)
+{
+	const struct matcher * m = &matchers[dir_pos];
+	struct match_event e = { .dir_pos = dir_pos, .name = name, .mask = mask, .stat_res = 1, .content_type = -2 };
+	size_t len = strlen(name);
+	int best = match_rules_len;
+	int node;
+
+	// exact names and prefixes
+	node = 0;
+	for (size_t i = 0; node != -1; i++) {
+		best = trie_entries_best(&m->prefixes, m->prefixes.nodes[node].rules, best, &e);
+
+		if (i == len) {
+			best = trie_entries_best(&m->prefixes, m->prefixes.nodes[node].exact, best, &e);
+			break;
+		}
+
+		node = trie_child(&m->prefixes, node, name[i]);
+	}
+
+	// suffixes
+	node = 0;
+	for (size_t i = len; node != -1; i--) {
+		best = trie_entries_best(&m->suffixes, m->suffixes.nodes[node].rules, best, &e);
+
+		if (i == 0)
+			break;
+
+		node = trie_child(&m->suffixes, node, name[i - 1]);
+	}
+
+	for (int k = 0; k < m->others_len && m->others[k] < best; k++) {
+		struct rule * r = match_rules[m->others[k]];
+		bool matched;
+
+		switch (r->match_kind) {
+		case MATCH_GLOB:
+			matched = fnmatch(r->glob, name, 0) == 0;
+			break;
+		case MATCH_REGEX:
+			matched = regexec(&r->regex_comp, name, 0, NULL, 0) == 0;
+			break;
+		default:
+			matched = true;
+		}
+
+		if (matched && rule_accepts(r, &e)) {
+			best = m->others[k];
+			break;
+		}
+	}
+
+	*content_type = e.content_type >= 0 ? e.content_type : -1;
+
+	return best < match_rules_len ? match_rules[best] : NULL;
+}
+
+
+/*
+ * tail mode
+ *
+ * files of tail rules are not processed when they are closed: they are followed while they grow,
+ * like tail -F. an IN_MODIFY event arms the timer of the file, and when tail_delay_ms expires the
+ * bytes appended in the meantime are passed to a single handler on its stdin (see job_stdin()).
+ * a file has at most one job at a time, so its bytes are delivered in order; the bytes appended
+ * while the job runs are delivered by the next one.
+ *
+ * a file is identified by its inode, not by its name: when it is renamed within the directory
+ * (rotation) it is followed with its new name, when it is removed or moved away it is read to its
+ * end and closed; a new file with the old name is followed from offset 0.
+ * a file which shrinks below the offset already delivered (truncation, e.g. copytruncate) is
+ * followed again from offset 0. the size is checked on every IN_MODIFY, and the last bytes
+ * delivered are compared with the ones kept when they were passed to a job: a file truncated and
+ * written again past the offset before filemon reads its events is not taken for an append.
+ */
+
+static struct tail_file * tail_files = NULL;
+
+static void tail_flush(struct timer * timer);
+
+// keeps the bytes of file t before its offset
+static void tail_mark(struct tail_file * t)
+{
+	t->mark_len = t->offset < TAIL_MARK_LEN ? t->offset : TAIL_MARK_LEN;
+
+	if (pread(t->fd, t->mark, t->mark_len, t->offset - t->mark_len) != t->mark_len)
+		t->mark_len = 0;
+}
+
+// follows file t again from offset 0 if it has been truncated since its bytes were delivered:
+// it is shorter than the offset, or the bytes before the offset are not the ones kept by tail_mark()
+static void tail_check(struct tail_file * t, const struct stat * st)
+{
+	char buf[TAIL_MARK_LEN];
+
+	if (t->offset == 0)
+		return;
+
+	if (st->st_size >= t->offset && (t->mark_len == 0 ||
+			(pread(t->fd, buf, t->mark_len, t->offset - t->mark_len) == t->mark_len &&
+			memcmp(buf, t->mark, t->mark_len) == 0)))
+		return;
+
+	syslog(LOG_WARNING, "tail: %s/%s truncated (offset %lld, now %lld bytes), following it from offset 0",
+			watched_dirs[t->dir_pos], t->name, (long long) t->offset, (long long) st->st_size);
+	t->offset = 0;
+	t->mark_len = 0;
+	t->rule->tail_truncations++;
+}
+
+static struct tail_file * tail_find(int dir_pos, const char * name)
+{
+	for (struct tail_file * t = tail_files; t != NULL; t = t->next) {
+		if (!t->detached && t->dir_pos == dir_pos && strcmp(t->name, name) == 0)
+			return t;
+	}
+
+	return NULL;
+}
+
+static struct tail_file * tail_find_inode(int dir_pos, dev_t dev, ino_t ino)
+{
+	for (struct tail_file * t = tail_files; t != NULL; t = t->next) {
+		if (t->dir_pos == dir_pos && t->dev == dev && t->ino == ino)
+			return t;
+	}
+
+	return NULL;
+}
+
+// starts following the regular file name of watched directory dir_pos, from its end or from its start
+static struct tail_file * tail_open(struct rule * r, int dir_pos, const char * name, bool from_end)
+{
+	struct stat st;
+	int fd = openat(dir_fds[dir_pos], name, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct tail_file * t = calloc(1, sizeof(struct tail_file));
+	if (t == NULL) {
+		syslog(LOG_ERR, "cannot allocate tail file");
+		exit(EXIT_FAILURE);
+	}
+
+	t->rule = r;
+	t->dir_pos = dir_pos;
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->fd = fd;
+	t->dev = st.st_dev;
+	t->ino = st.st_ino;
+	t->offset = from_end ? st.st_size : 0;
+	tail_mark(t);
+	t->timer.fn = tail_flush;
+	t->timer.arg = t;
+	t->timer.heap_pos = -1;
+
+	t->next = tail_files;
+	tail_files = t;
+	r->tail_files++;
+
+	syslog(LOG_INFO, "tail: following %s/%s from offset %lld", watched_dirs[dir_pos], name, (long long) t->offset);
+
+	return t;
+}
+
+static void tail_close(struct tail_file * t)
+{
+	for (struct tail_file ** p = &tail_files; *p != NULL; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+
+	syslog(LOG_INFO, "tail: %s/%s closed at offset %lld", watched_dirs[t->dir_pos], t->name, (long long) t->offset);
+
+	timer_cancel(&t->timer);
+	close(t->fd);
+	t->rule->tail_files--;
+	free(t);
+}
+
+// the name of file t has been removed or belongs to another file: t is read to its end, then closed
+static void tail_detach(struct tail_file * t)
+{
+	t->detached = true;
+	t->rule->tail_rotations++;
+
+	if (t->timer.heap_pos == -1)
+		timer_arm(&t->timer, now_ns());
+}
+
+// passes the bytes appended to file t since the last job to a new job
+static void tail_flush(struct timer * timer)
+{
+	struct tail_file * t = timer->arg;
+	struct stat st;
+
+	// bytes appended while a job runs are delivered when it is over
+	if (t->job != NULL)
+		return;
+
+	if (fstat(t->fd, &st) == -1) {
+		syslog(LOG_ERR, "tail: fstat %s: %s", t->name, strerror(errno));
+		tail_close(t);
+		return;
+	}
+
+	tail_check(t, &st);
+
+	if (st.st_size == t->offset) {
+		if (t->detached)
+			tail_close(t);
+		return;
+	}
+
+	struct job * j = job_alloc();
+
+	j->rule = t->rule;
+	j->mask = IN_MODIFY;
+	j->enqueue_ns = now_ns();
+	j->event_ts_ns = t->event_ts_ns;
+	j->tail = t;
+	j->stdin_start = t->offset;
+	j->stdin_end = st.st_size;
+	job_set_path(j, t->dir_pos, t->name);
+
+	t->offset = st.st_size;
+	tail_mark(t);
+	t->job = j;
+
+	job_submit(j);
+	stats.jobs_queued++;
+}
+
+// called when the job of a tail file is over, also if it has failed for good
+static void tail_job_done(struct job * j)
+{
+	struct tail_file * t = j->tail;
+
+	t->job = NULL;
+
+	// the bytes appended while the job was running, or the end of a detached file
+	if (t->timer.heap_pos == -1)
+		timer_arm(&t->timer, now_ns());
+}
+
+// inotify event about file name of watched directory dir_pos, for tail rule r
+static void tail_event(struct rule * r, int dir_pos, const char * name, uint32_t mask, uint64_t event_ts_ns)
+{
+	struct tail_file * t = tail_find(dir_pos, name);
+
+	if (dir_fds[dir_pos] == -1 || (mask & IN_ISDIR))
+		return;
+
+	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (t != NULL)
+			tail_detach(t);
+		return;
+	}
+
+	if (!(mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE)))
+		return;
+
+	if (mask & (IN_CREATE | IN_MOVED_TO)) {
+		struct stat st;
+
+		if (fstatat(dir_fds[dir_pos], name, &st, 0) == -1)
+			return;
+
+		// another file has taken the name
+		if (t != NULL && (st.st_dev != t->dev || st.st_ino != t->ino)) {
+			tail_detach(t);
+			t = NULL;
+		}
+
+		// a followed file renamed within the directory (e.g. app.log -> app.log.1) keeps its offset
+		if (t == NULL && (t = tail_find_inode(dir_pos, st.st_dev, st.st_ino)) != NULL) {
+			snprintf(t->name, sizeof(t->name), "%s", name);
+			t->detached = false;
+		}
+	}
+
+	// a file created or moved in while filemon runs is followed from its start
+	if (t == NULL) {
+		t = tail_open(r, dir_pos, name, false);
+		if (t == NULL)
+			return;
+	} else if (mask & IN_MODIFY) {
+		// a truncation followed by writes must be noticed before the timer expires
+		struct stat st;
+
+		if (fstat(t->fd, &st) == 0)
+			tail_check(t, &st);
+	}
+
+	if (t->timer.heap_pos == -1) {
+		t->event_ts_ns = event_ts_ns;
+		timer_arm(&t->timer, now_ns() + r->tail_delay_ms * NS_PER_MS);
+	}
+}
+
+// follows the files of tail rules already in watched directory dir_pos from their end, as tail -F
+static void tail_scan(int dir_pos)
+{
+	int fd = openat(dir_fds[dir_pos], ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR * d = fd != -1 ? fdopendir(fd) : NULL;
+	struct dirent * de;
+
+	if (d == NULL) {
+		syslog(LOG_ERR, "tail: cannot read directory %s", watched_dirs[dir_pos]);
+		exit(EXIT_FAILURE);
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+			continue;
+
+		int content_type;
+		struct rule * r = rule_match(dir_pos, de->d_name, 0, &content_type);
+
+		if (r != NULL && r->tail)
+			tail_open(r, dir_pos, de->d_name, true);
+	}
+
+	closedir(d);
+}
+
+
+/*
+ * groups
+ *
+ * producers often write a set of files followed by a marker (batch.done, x.md5). files of rules
+ * with group_marker wait in the list of their rule until a marker arrives; then the command is
+ * executed once, with the files completed by the marker as arguments (sh -c 'command "$@"'),
+ * instead of once per file. with GROUP_BY_DIR a marker completes the waiting files of its
+ * directory, with GROUP_BY_STEM the ones whose name is the name of the marker without its
+ * extension, optionally followed by more extensions (x.md5 completes x, x.csv, x.csv.gz).
+ * dispositions apply to each file of the group and to the marker.
+ */
+
+// true if job m waits for marker, the job of the marker file
+static bool group_completes(const struct rule * r, const struct job * marker, const struct job * m)
+{
+	if (m->dir_pos != marker->dir_pos)
+		return false;
+
+	if (r->group_by == GROUP_BY_DIR)
+		return true;
+
+	const char * marker_name = strrchr(marker->path, '/') + 1;
+	const char * dot = strrchr(marker_name, '.');
+	size_t stem_len = dot != NULL ? (size_t) (dot - marker_name) : strlen(marker_name);
+	const char * name = strrchr(m->path, '/') + 1;
+
+	return strncmp(name, marker_name, stem_len) == 0 && (name[stem_len] == 0 || name[stem_len] == '.');
+}
+
+// submits job lead with the files of members as a group; files beyond GROUP_ARGS_LEN make more groups
+static void group_submit(struct rule * r, struct job * lead, struct job * members, bool marker)
+{
+	// files renamed to a name of another rule while they waited leave the group
+	for (struct job ** p = &members; *p != NULL; ) {
+		struct job * m = *p;
+
+		if (m->renamed_away) {
+			*p = m->next;
+			job_free(m);
+			continue;
+		}
+
+		rename_job_del(m);
+		p = &m->next;
+	}
+
+	if (!marker && lead->renamed_away) {
+		job_free(lead);
+		lead = members;
+		if (lead == NULL)
+			return;
+		members = lead->next;
+		lead->next = NULL;
+	}
+
+	rename_job_del(lead);
+
+	while (lead != NULL) {
+		size_t len = marker ? 0 : strlen(lead->path) + 1;
+		struct job ** tail = &lead->members;
+
+		lead->group_marker = marker;
+		lead->group_size = marker ? 0 : 1;
+		lead->members = NULL;
+
+		while (members != NULL && len + strlen(members->path) + 1 <= GROUP_ARGS_LEN) {
+			struct job * m = members;
+
+			members = m->next;
+			m->next = NULL;
+			*tail = m;
+			tail = &m->next;
+			len += strlen(m->path) + 1;
+			lead->group_size++;
+		}
+
+		if (lead->group_size == 0) {
+			syslog(LOG_INFO, "group marker without files: %s", lead->path);
+			job_free(lead);
+			return;
+		}
+
+		syslog(LOG_INFO, "group of %d files%s%s", lead->group_size, marker ? ", marker " : "", marker ? lead->path : "");
+
+		r->groups++;
+		job_submit(lead);
+		stats.jobs_queued++;
+
+		// the files which do not fit make another group, without marker
+		lead = members;
+		if (lead != NULL) {
+			members = lead->next;
+			lead->next = NULL;
+		}
+		marker = false;
+	}
+}
+
+static void group_timeout(struct timer * t);
+
+// job j, created by an event of a group rule: a marker, or a file which waits for one
+static void group_add(struct job * j)
+{
+	struct rule * r = j->rule;
+	struct job ** p;
+
+	if (fnmatch(r->group_marker, strrchr(j->path, '/') + 1, 0) == 0) {
+		struct job * members = NULL;
+		struct job ** tail = &members;
+
+		for (p = &r->group_head; *p != NULL; ) {
+			struct job * m = *p;
+
+			if (!group_completes(r, j, m)) {
+				p = &m->next;
+				continue;
+			}
+
+			*p = m->next;
+			m->next = NULL;
+			*tail = m;
+			tail = &m->next;
+			r->group_waiting--;
+		}
+
+		group_submit(r, j, members, true);
+		return;
+	}
+
+	// a file closed again while it waits is in the group once
+	for (p = &r->group_head; *p != NULL; p = &(*p)->next) {
+		if (strcmp((*p)->path, j->path) == 0) {
+			job_free(j);
+			return;
+		}
+	}
+
+	j->next = NULL;
+	*p = j;
+	r->group_waiting++;
+
+	if (r->group_timeout_ms > 0 && r->group_timer.heap_pos == -1) {
+		r->group_timer.fn = group_timeout;
+		r->group_timer.arg = r;
+		timer_arm(&r->group_timer, r->group_head->enqueue_ns + r->group_timeout_ms * NS_PER_MS);
+	}
+}
+
+// the files which have waited group_timeout_ms are processed without marker, a group per directory
+static void group_timeout(struct timer * t)
+{
+	struct rule * r = t->arg;
+	uint64_t deadline = now_ns() - r->group_timeout_ms * NS_PER_MS;
+
+	while (r->group_head != NULL && r->group_head->enqueue_ns <= deadline) {
+		struct job * lead = r->group_head;
+		struct job * members = NULL;
+		struct job ** tail = &members;
+
+		r->group_head = lead->next;
+		lead->next = NULL;
+		r->group_waiting--;
+
+		for (struct job ** p = &r->group_head; *p != NULL; ) {
+			struct job * m = *p;
 
-#include <sys/inotify.h>
-#include <limits.h>
+			if (m->dir_pos != lead->dir_pos || m->enqueue_ns > deadline) {
+				p = &m->next;
+				continue;
+			}
 
-#include <sys/wait.h>
+			*p = m->next;
+			m->next = NULL;
+			*tail = m;
+			tail = &m->next;
+			r->group_waiting--;
+		}
 
-#include <syslog.h>
+		syslog(LOG_WARNING, "group timeout, no marker: %s", lead->path);
+		group_submit(r, lead, members, false);
+	}
 
+	if (r->group_head != NULL)
+		timer_arm(&r->group_timer, r->group_head->enqueue_ns + r->group_timeout_ms * NS_PER_MS);
+}
 
-typedef char * char_p;
 
-// stores command to execute on file
-char * command = NULL;
+/*
+ * settle
+ *
+ * some producers close and reopen a file several times while they write it. jobs of rules with
+ * settle_ms wait in a single list, and a single timer checks all of them every settle_tick_ms
+ * with statx(): a job is submitted when the size and mtime of its file have not changed for
+ * settle_ms. further events about a file already in the list are merged into its job.
+ */
 
-// on linux, PATH_MAX is 4096
-#define MAX_COMMAND_LEN (PATH_MAX*2)
+#define SETTLE_TICK_MIN_MS 10
 
-char *space = " ";
-char *slash = "/";
+// half of the smallest settle_ms
+static long settle_tick_ms = 0;
+
+static void settle_check(struct timer * t);
+
+static struct timer settle_timer = TIMER_INIT(settle_check, NULL);
+
+// reads size and mtime of the file of job j; returns -1 if the file is gone
+static int settle_stat(struct job * j, uint64_t * size, uint64_t * mtime_ns)
+{
+	struct statx stx;
+	int res;
+
+	stats.settle_checks++;
+
+	if (j->fd != -1)
+		res = statx(j->fd, "", AT_EMPTY_PATH, STATX_SIZE | STATX_MTIME, &stx);
+	else
+		res = statx(dir_fds[j->dir_pos], strrchr(j->path, '/') + 1, 0, STATX_SIZE | STATX_MTIME, &stx);
+
+	if (res == -1)
+		return -1;
+
+	*size = stx.stx_size;
+	*mtime_ns = (uint64_t) stx.stx_mtime.tv_sec * NS_PER_SEC + stx.stx_mtime.tv_nsec;
+
+	return 0;
+}
+
+// job j waits until its file settles, at the end of the list
+static void settle_add(struct job * j)
+{
+	struct job ** tail = &settle_head;
+
+	for (; *tail != NULL; tail = &(*tail)->next) {
+		struct job * p = *tail;
+
+		if (p->rule == j->rule && strcmp(p->path, j->path) == 0) {
+			// the file has changed: its wait starts again
+			p->settle_change_ns = now_ns();
+			stats.settle_merged++;
+			job_free(j);
+			return;
+		}
+	}
+
+	if (settle_stat(j, &j->settle_size, &j->settle_mtime_ns) == -1) {
+		syslog(LOG_WARNING, "cannot stat %s: %s", j->path, strerror(errno));
+		stats.jobs_vanished++;
+		job_free(j);
+		return;
+	}
+
+	j->settle_change_ns = now_ns();
+	j->next = NULL;
+	*tail = j;
+	settle_len++;
+	stats.jobs_queued++;
+
+	if (settle_timer.heap_pos == -1)
+		timer_arm(&settle_timer, now_ns() + settle_tick_ms * NS_PER_MS);
+}
+
+static void settle_check(struct timer * t)
+{
+	(void) t;       // settle_timer
+
+	uint64_t now = now_ns();
+
+	for (struct job ** p = &settle_head; *p != NULL; ) {
+		struct job * j = *p;
+		uint64_t size, mtime_ns;
+
+		if (settle_stat(j, &size, &mtime_ns) == -1) {
+			syslog(LOG_WARNING, "%s has vanished while settling", j->path);
+			*p = j->next;
+			settle_len--;
+			stats.jobs_vanished++;
+			job_free(j);
+			continue;
+		}
+
+		if (size != j->settle_size || mtime_ns != j->settle_mtime_ns) {
+			j->settle_size = size;
+			j->settle_mtime_ns = mtime_ns;
+			j->settle_change_ns = now;
+		} else if (now - j->settle_change_ns >= (uint64_t) j->rule->settle_ms * NS_PER_MS) {
+			*p = j->next;
+			settle_len--;
+			job_submit(j);
+			continue;
+		}
+
+		p = &j->next;
+	}
+
+	if (settle_head != NULL)
+		timer_arm(&settle_timer, now + settle_tick_ms * NS_PER_MS);
+}
+
+// computes settle_tick_ms from the settle_ms of the rules
+static void settle_init(void)
+{
+	for (int i = 0; i < rules_len; i++) {
+		long tick = rules[i]->settle_ms / 2;
+
+		if (rules[i]->settle_ms == 0)
+			continue;
+
+		if (tick < SETTLE_TICK_MIN_MS)
+			tick = SETTLE_TICK_MIN_MS;
+
+		if (settle_tick_ms == 0 || tick < settle_tick_ms)
+			settle_tick_ms = tick;
+	}
+}
+
+
+/*
+ * rename commit
+ *
+ * producers which write a file with a temporary name and rename it when it is complete make
+ * filemon see two events: IN_CLOSE_WRITE of the temporary name, then IN_MOVED_FROM and
+ * IN_MOVED_TO with the same cookie. in rules with rename_commit, closes of temporary names are
+ * ignored and IN_MOVED_TO completes the file. IN_MOVED_FROM is remembered for RENAME_PAIR_MS in
+ * rename_pairs, so that IN_MOVED_TO knows where the file comes from:
+ * - from outside the watched directories, or from a temporary name: the file is processed;
+ * - from a file whose job has not started yet (see rename_job_add()): the job takes the new name,
+ *   the file is processed once; if the new name belongs to another rule, the job is dropped and
+ *   the file is processed by that rule;
+ * - from a file already processed: it is not processed again.
+ */
+
+#define RENAME_PAIRS 64
+#define RENAME_PAIR_MS 1000
+
+struct rename_pair {
+	uint32_t cookie;            // 0 = free
+	uint64_t deadline_ns;       // the pair is forgotten after this time
+	struct rule * rule;         // rule of the old name
+	int dir_pos;
+	bool temp;                  // the old name is a temporary name
+	char name[NAME_MAX + 1];    // old name
+};
+
+// IN_MOVED_FROM events, overwritten in order
+static struct rename_pair rename_pairs[RENAME_PAIRS];
+static int rename_pairs_next = 0;
+
+// temporary names: temp_glob, or hidden names and the names excluded by --exclude-temp
+static bool rename_temp_name(const struct rule * r, const char * name)
+{
+	if (r->temp_glob != NULL)
+		return fnmatch(r->temp_glob, name, 0) == 0;
+
+	if (name[0] == '.')
+		return true;
+
+	for (int i = 0; temp_patterns[i] != NULL; i++) {
+		if (fnmatch(temp_patterns[i], name, 0) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// the job of rule r about file name of watched directory dir_pos which has not started yet, or NULL
+static struct job * rename_queued_job(struct rule * r, int dir_pos, const char * name)
+{
+	for (struct job * j = *rename_jobs_bucket(r, dir_pos, name); j != NULL; j = j->rename_next) {
+		if (j->dir_pos == dir_pos && strcmp(strrchr(j->path, '/') + 1, name) == 0)
+			return j;
+	}
+
+	return NULL;
+}
+
+// event i about a file of rename_commit rule r; returns true if the file must be processed
+static bool rename_event(struct rule * r, const struct inotify_event * i, int dir_pos)
+{
+	struct rename_pair * p;
+
+	if (i->mask & IN_MOVED_FROM) {
+		p = &rename_pairs[rename_pairs_next];
+		rename_pairs_next = (rename_pairs_next + 1) % RENAME_PAIRS;
+
+		p->cookie = i->cookie;
+		p->deadline_ns = now_ns() + RENAME_PAIR_MS * NS_PER_MS;
+		p->rule = r;
+		p->dir_pos = dir_pos;
+		p->temp = rename_temp_name(r, i->name);
+		snprintf(p->name, sizeof(p->name), "%s", i->name);
+		return false;
+	}
+
+	if (!(i->mask & IN_MOVED_TO)) {
+		if (rename_temp_name(r, i->name)) {
+			r->temp_closes++;
+			return false;
+		}
+		return true;
+	}
+
+	uint64_t now = now_ns();
+
+	for (p = rename_pairs; p < rename_pairs + RENAME_PAIRS; p++) {
+		if (p->cookie == i->cookie && p->deadline_ns >= now)
+			break;
+	}
+
+	// moved in from outside the watched directories, or from a name of another rule
+	if (p == rename_pairs + RENAME_PAIRS)
+		return true;
+
+	p->cookie = 0;
+
+	if (p->temp)
+		return true;
+
+	struct job * j = rename_queued_job(p->rule, p->dir_pos, p->name);
+
+	if (j == NULL) {
+		p->rule->renames_skipped++;
+		return false;
+	}
+
+	// the new name belongs to another rule: the job is dropped, the new name is processed by r
+	if (r != p->rule) {
+		syslog(LOG_INFO, "waiting job renamed to a file of rule %s: %s -> %s", r->name, p->name, i->name);
+		rename_job_del(j);
+		j->renamed_away = true;
+		p->rule->renames_rerouted++;
+		return true;
+	}
+
+	syslog(LOG_INFO, "waiting job renamed: %s -> %s", p->name, i->name);
+	rename_job_del(j);
+	job_set_path(j, dir_pos, i->name);
+	rename_job_add(j);
+	r->renames_retargeted++;
+
+	return false;
+}
 
-const char * FILEMON = "filemon";
 
-static void show_inotify_event(struct inotify_event *i, char_p dir_name)
+static void show_inotify_event(struct inotify_event *i, char_p dir_name, int dir_pos, uint64_t event_ts_ns)
 {
 	syslog(LOG_INFO,"show_inotify_event [dir_name='%s' wd=%2d] ",dir_name, i->wd);
 
@@ -100,83 +6193,122 @@ static void show_inotify_event(struct inotify_event *i, char_p dir_name)
 
     syslog(LOG_INFO, "%s", mask_str);
 
+    // events about the watched directory itself are not matched
+    int content_type = -1;
+    struct rule * r = i->len ? rule_match(dir_pos, i->name, i->mask, &content_type) : NULL;
 
-    if ((i->mask & IN_CLOSE_WRITE)/* || (i->mask & IN_CLOSE_NOWRITE)*/) {
-    	// execute command passing file as parameter
-    	if (i->len) {
-
-    		char cmd[PATH_MAX];
-    		cmd[0] = 0;
+    if (r == NULL) {
+    	stats.events_unmatched++;
+    	return;
+    }
 
-    		// append command to cmd
-    		strcat(cmd, command);
+    r->events_matched++;
 
-    		// append ' ' to cmd
-    		strcat(cmd, space);
+    if (r->tail) {
+    	tail_event(r, dir_pos, i->name, i->mask, event_ts_ns);
+    	return;
+    }
 
-    		// append dir_name
-    		strcat(cmd, dir_name);
+    if (r->rename_commit && !rename_event(r, i, dir_pos))
+    	return;
 
-    		// check if dir_name ends with slash symbol
-    		if (dir_name[strlen(dir_name)] != '/') {
-    			strcat(cmd, slash);
-    		}
+    // queue a job which executes command passing file as parameter
+    struct job * j = job_alloc();
 
-    		// append file name do cmd
-    		strncat(cmd, i->name, i->len);
+    j->rule = r;
+    j->mask = i->mask;
+    j->enqueue_ns = now_ns();
+    j->event_ts_ns = event_ts_ns;
+    j->content_type = content_type;
+    job_set_path(j, dir_pos, i->name);
 
-    		syslog(LOG_INFO, "cmd: %s", cmd);
+    // the file is opened now, relative to the directory: the handler gets this file
+    // even if it is renamed while the job waits in the queue
+    if (r->pass_fd && dir_fds[dir_pos] != -1) {
+    	j->fd = openat(dir_fds[dir_pos], i->name, O_RDONLY | O_CLOEXEC);
+    	if (j->fd == -1) {
+    		syslog(LOG_WARNING, "cannot open %s: %s", j->path, strerror(errno));
+    		stats.jobs_vanished++;
+    		job_free(j);
+    		return;
+    	}
+    }
 
-    		pid_t child_pid;
-    		int wstatus;
-    		int modal_result = -1;
+    // the job waits from now on: a rename of the file finds it
+    rename_job_add(j);
 
-    		switch (child_pid = fork()) {
-    		case -1:
-    			perror("cannot fork");
-    			exit(EXIT_FAILURE);
-    		case 0:
+    if (r->group_marker != NULL) {
+    	group_add(j);
+    	return;
+    }
 
-    			child_pid = getpid();
-    			syslog(LOG_INFO, "[child process] pid=%d", child_pid);
+    if (r->settle_ms > 0) {
+    	settle_add(j);
+    	return;
+    }
 
-    			if (execl("/bin/sh", "sh", "-c", cmd, (char *) NULL) != 0) {
-    				syslog(LOG_ERR, "[child process] execl");
-    				exit(EXIT_FAILURE);
-    			}
+    job_submit(j);
+    stats.jobs_queued++;
+}
 
-    			break;
-    		default:
-    			;
-    		}
 
+#define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
 
-    		do {
-            	pid_t ws = waitpid(child_pid, &wstatus, 0);
-                if (ws == -1) {
-                	syslog(LOG_ERR, "[parent] waitpid");
-                    exit(EXIT_FAILURE);
-                }
+static volatile sig_atomic_t stop_requested = 0;
 
-                if (WIFEXITED(wstatus)) {
+static void stop_handler(int sig)
+{
+	(void) sig;
+	stop_requested = 1;
+}
 
-                	modal_result = WEXITSTATUS(wstatus);
+char buf[BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
 
-                	syslog(LOG_DEBUG, "[parent] child process has terminated, returning: %d", modal_result);
-                } else if (WIFSIGNALED(wstatus)) {
-                	syslog(LOG_DEBUG, "[parent] child process killed by signal %d", WTERMSIG(wstatus));
-                }
-            } while (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus));
+// the kernel queue of the inotify instance of reader (-1 without readers) has overflowed: the
+// events it has dropped are lost, filemon goes on with the next ones
+static void queue_overflow(int reader, uint64_t event_ts_ns)
+{
+	stats.queue_overflows++;
 
+	if (reader >= 0) {
+		shards[reader].overflows++;
+		syslog(LOG_WARNING, "reader %d: inotify queue overflow, events have been lost", reader);
+	} else
+		syslog(LOG_WARNING, "inotify queue overflow, events have been lost");
 
-    	}
-    }
+	// the bytes appended to followed files are found by their size, also without their IN_MODIFY
+	for (struct tail_file * t = tail_files; t != NULL; t = t->next) {
+		if (t->timer.heap_pos == -1) {
+			t->event_ts_ns = event_ts_ns;
+			timer_arm(&t->timer, now_ns() + t->rule->tail_delay_ms * NS_PER_MS);
+		}
+	}
 }
 
+// an event read from inotify; dir_pos is the watched directory of event->wd, -1 if not found
+static void process_event(struct inotify_event * event, int dir_pos, uint64_t event_ts_ns)
+{
+	// IN_Q_OVERFLOW has no watch descriptor
+	if (event->mask & IN_Q_OVERFLOW) {
+		queue_overflow(-1, event_ts_ns);
+		return;
+	}
 
-#define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+	stats.events++;
 
-char buf[BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	// before anything else is done with the event
+	if (event->len > 0 && !filter_pass(event->name)) {
+		stats.events_filtered++;
+		return;
+	}
+
+	if (dir_pos == -1) {
+		syslog(LOG_ERR, "cannot find directory name!");
+		exit(EXIT_FAILURE);
+	}
+
+	show_inotify_event(event, watched_dirs[dir_pos], dir_pos, event_ts_ns);
+}
 // https://gcc.gnu.org/onlinedocs/gcc/Alignment.html
 
 
@@ -186,32 +6318,65 @@ void monitor(char_p directories[], int directories_len) {
 	int inotifyFd;
 	int num_bytes_read;
 	int * wd_names;
+	struct pollfd * fds;
+	struct job ** fds_jobs;
+
+	watched_dirs = directories;
+	watched_dirs_len = directories_len;
 
 	wd_names = calloc(directories_len, sizeof(int));
-	if (wd_names == NULL) {
+	dir_fds = calloc(directories_len, sizeof(int));
+	dir_usage = calloc(directories_len, sizeof(struct usage));
+	if (wd_names == NULL || dir_fds == NULL || dir_usage == NULL) {
 		syslog(LOG_ERR, "calloc error");
         exit(EXIT_FAILURE);
 	}
 
-	// inotify_init() initializes a new inotify instance and
-	// returns a file descriptor associated with a new inotify event queue.
-    inotifyFd = inotify_init();
-    if (inotifyFd == -1) {
-    	syslog(LOG_ERR, "inotify_init");
+	running = calloc(max_jobs, sizeof(struct job *));
+	if (running == NULL) {
+		syslog(LOG_ERR, "calloc error");
+        exit(EXIT_FAILURE);
+	}
+
+	// poll() on the inotify fd, the zygote socket, the eventfd of worker threads,
+	// the pidfd and the stdin and output pipes of every running handler
+	fds = calloc(3 + 3 * max_jobs, sizeof(struct pollfd));
+	fds_jobs = calloc(3 + 3 * max_jobs, sizeof(struct job *));
+	if (fds == NULL || fds_jobs == NULL) {
+		syslog(LOG_ERR, "calloc error");
         exit(EXIT_FAILURE);
+	}
+
+	// inotify_init1() initializes a new inotify instance and
+	// returns a file descriptor associated with a new inotify event queue.
+	// the file descriptor is not inherited by handlers
+    if (readers > 0) {
+    	inotifyFd = -1;
+    	shards_init(directories, directories_len);
+    } else {
+    	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    	if (inotifyFd == -1) {
+    		syslog(LOG_ERR, "inotify_init");
+    		exit(EXIT_FAILURE);
+    	}
     }
 
     // for each command line argument:
-    for (int j = 0; j < directories_len; j++) {
+    for (int j = 0, k = 0; j < directories_len; j++) {
+
+    	dir_fds[j] = -1;
 
     	if (directories[j] == NULL)
     		continue;
 
         syslog(LOG_INFO, "watching %s", directories[j]);
 
+        // with readers, directories are assigned to them in turn
+        struct shard * s = shards_len > 0 ? &shards[k++ % shards_len] : NULL;
+
     	// inotify_add_watch()  adds  a  new  watch, or modifies an existing watch,
     	// for the file whose location is specified in pathname
-        wd = inotify_add_watch(inotifyFd, directories[j], IN_ALL_EVENTS);
+        wd = inotify_add_watch(s != NULL ? s->fd : inotifyFd, directories[j], IN_ALL_EVENTS);
         if (wd == -1) {
         	syslog(LOG_ERR, "inotify_init");
             exit(EXIT_FAILURE);
@@ -220,12 +6385,163 @@ void monitor(char_p directories[], int directories_len) {
         // associate watch descriptor to position of name in the array of strings
         wd_names[j] = wd;
 
+        if (s != NULL) {
+        	s->dir_pos[s->dirs_len] = j;
+        	s->wds[s->dirs_len++] = wd;
+        }
+
+        // files are opened relative to their directory; fails with ENOTDIR for watched files.
+        // not O_PATH: the directory is fsync()ed by durable dispositions
+        dir_fds[j] = open(directories[j], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    }
+
+    rules_compile();
+    settle_init();
+
+    // after the watches are added: no byte appended in between is missed
+    for (int i = 0; i < rules_len; i++) {
+    	if (rules[i]->tail) {
+    		for (int j = 0; j < directories_len; j++) {
+    			if (dir_fds[j] != -1)
+    				tail_scan(j);
+    		}
+    		break;
+    	}
+    }
+
+    // the event reader keeps a CPU of its own, handlers get the others
+    if (reader_cpu >= 0) {
+    	cpu_set_t reader_set;
+
+    	if (sched_getaffinity(0, sizeof(cpu_set_t), &handler_cpus) == -1) {
+    		syslog(LOG_ERR, "sched_getaffinity");
+    		exit(EXIT_FAILURE);
+    	}
+
+    	CPU_ZERO(&reader_set);
+    	CPU_SET(reader_cpu, &reader_set);
+    	CPU_CLR(reader_cpu, &handler_cpus);
+
+    	if (CPU_COUNT(&handler_cpus) == 0 || sched_setaffinity(0, sizeof(cpu_set_t), &reader_set) == -1) {
+    		syslog(LOG_ERR, "cannot reserve CPU %d to filemon", reader_cpu);
+    		exit(EXIT_FAILURE);
+    	}
+
+    	syslog(LOG_INFO, "reader pinned to CPU %d", reader_cpu);
+    }
+
+    // worker threads are started only when a rule needs them
+    for (int i = 0; i < rules_len; i++) {
+    	if (rules[i]->plugin_ops != NULL || rules[i]->checksum != CHECKSUM_NONE || rules[i]->durable || rules[i]->evict) {
+    		workers_start();
+    		break;
+    	}
+    }
+
+    // SIGTERM and SIGINT interrupt poll(): the loop stops, and plugins are shut down
+    struct sigaction sa = { .sa_handler = stop_handler };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    // a handler which closes stdin early makes splice() fail with EPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    if (adaptive) {
+    	psi_open();
+    	aimd.period_start_ns = now_ns();
+    	psi_read(0);
+    	timer_arm(&aimd_timer, aimd.period_start_ns + AIMD_PERIOD_MS * NS_PER_MS);
     }
 
+    if (metrics_file != NULL)
+    	timer_arm(&metrics_timer, now_ns() + METRICS_PERIOD_MS * NS_PER_MS);
+
+    if (shards_len > 0)
+    	shards_start();
+
     syslog(LOG_INFO, "ready!");
 
-    // loop forever
-    for (;;) {
+    // with readers, their events are signaled by shards_fd
+    fds[0].fd = shards_len > 0 ? shards_fd : inotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = zygote_fd;      // ignored by poll() when -1
+    fds[1].events = POLLIN;
+    fds[2].fd = work_done_fd;   // ignored by poll() when -1
+    fds[2].events = POLLIN;
+
+    // loop until SIGTERM or SIGINT
+    while (!stop_requested) {
+    	int nfds = 3;
+
+    	// pipes come first: they are read and written before a terminated handler is reaped
+    	for (int i = 0; i < jobs_running; i++) {
+    		if (running[i]->stdin_fd != -1) {
+    			fds[nfds].fd = running[i]->stdin_fd;
+    			fds[nfds].events = POLLOUT;
+    			fds_jobs[nfds++] = running[i];
+    		}
+
+    		// the header of the output names the pid, unknown until the zygote replies
+    		if (running[i]->output_fd != -1 && running[i]->pidfd != -1) {
+    			fds[nfds].fd = running[i]->output_fd;
+    			fds[nfds].events = POLLIN;
+    			fds_jobs[nfds++] = running[i];
+    		}
+    	}
+
+    	for (int i = 0; i < jobs_running; i++) {
+    		// handlers requested to the zygote have no pidfd until the zygote replies
+    		if (running[i]->pidfd == -1)
+    			continue;
+
+    		fds[nfds].fd = running[i]->pidfd;
+    		fds[nfds].events = POLLIN;
+    		fds_jobs[nfds++] = running[i];
+    	}
+
+    	if (poll(fds, nfds, shards_pending ? 0 : timer_poll_timeout()) == -1) {
+    		if (errno == EINTR)
+    			continue;
+
+    		syslog(LOG_ERR, "poll()");
+    		exit(EXIT_FAILURE);
+    	}
+
+    	// input and output of handlers, then terminated handlers
+    	for (int i = 3; i < nfds; i++) {
+    		if (fds[i].revents == 0)
+    			continue;
+
+    		if (fds[i].fd == fds_jobs[i]->stdin_fd)
+    			job_stdin(fds_jobs[i]);
+    		else if (fds[i].fd == fds_jobs[i]->output_fd)
+    			job_output(fds_jobs[i]);
+    		else
+    			reap_job(fds_jobs[i]);
+    	}
+
+    	if (fds[1].revents & (POLLIN | POLLHUP))
+    		zygote_receive();
+
+    	if (fds[2].revents & POLLIN)
+    		work_complete();
+
+    	timer_run_expired();
+
+    	if (shards_len > 0 && ((fds[0].revents & POLLIN) || shards_pending)) {
+    		shards_drain();
+    		dispatch_jobs();
+    		continue;
+    	}
+
+    	if (!(fds[0].revents & POLLIN)) {
+    		dispatch_jobs();
+    		continue;
+    	}
+
     	num_bytes_read = read(inotifyFd, buf, BUF_LEN);
         if (num_bytes_read == 0) {
         	syslog(LOG_ERR, "read() from inotify fd returned 0!");
@@ -234,8 +6550,8 @@ void monitor(char_p directories[], int directories_len) {
 
         if (num_bytes_read == -1) {
 
-        	if (errno == EINTR) {
-        		syslog(LOG_ERR, "read(): EINTR");
+        	if (errno == EINTR || errno == EAGAIN) {
+        		syslog(LOG_DEBUG, "read(): %s", errno == EINTR ? "EINTR" : "EAGAIN");
 				continue;
         	} else {
         		syslog(LOG_ERR, "read()");
@@ -245,6 +6561,12 @@ void monitor(char_p directories[], int directories_len) {
 
         syslog(LOG_DEBUG, "read %d bytes from inotify fd", num_bytes_read);
 
+        // all of the events in buffer share the same timestamp
+        struct timespec event_ts;
+
+        clock_gettime(CLOCK_REALTIME, &event_ts);
+        uint64_t event_ts_ns = (uint64_t) event_ts.tv_sec * NS_PER_SEC + event_ts.tv_nsec;
+
         // process all of the events in buffer returned by read()
 
         struct inotify_event *event;
@@ -252,6 +6574,9 @@ void monitor(char_p directories[], int directories_len) {
         for (char * p = buf; p < buf + num_bytes_read; ) {
             event = (struct inotify_event *) p;
 
+            // event->len is length of (optional) file name
+            p += sizeof(struct inotify_event) + event->len;
+
             // recover directory name associated to wd
             int dir_pos = -1;
             for (int i = 0; i < directories_len; i++) {
@@ -261,29 +6586,110 @@ void monitor(char_p directories[], int directories_len) {
             	}
             }
 
-            if (dir_pos == -1) {
-            	syslog(LOG_ERR, "cannot find directory name!");
-            	exit(EXIT_FAILURE);
-            }
-
-            show_inotify_event(event, directories[dir_pos]);
-
-            p += sizeof(struct inotify_event) + event->len;
-            // event->len is length of (optional) file name
+            process_event(event, dir_pos, event_ts_ns);
         }
+
+        dispatch_jobs();
     }
 
+    // running handlers are not waited for
+    syslog(LOG_INFO, "terminating, %d handlers still running", jobs_running);
 
+    plugins_shutdown();
 }
 
 
 void show_help(int argc, char * argv[]) {
+	(void) argc;
 	fprintf(stderr, "monitors one or more files or directories specified as parameters; when a new file is detected, invokes an action on it.\n");
-    fprintf(stderr, "Usage: %s -d file/directory -c command\n", argv[0]);
+    fprintf(stderr, "Usage: %s -d file/directory -c command [options]\n", argv[0]);
     fprintf(stderr, "example: %s -d /tmp/ -d /home/marco/ -c \"ls -l\"\n", argv[0]);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -j, --jobs N               run up to N commands at the same time (default: 1)\n");
+    fprintf(stderr, "  --adaptive                 adapt the number of commands running at the same time to\n"
+    		        "                             command latency and /proc/pressure; -j is the upper bound\n"
+    		        "                             (default: 4 per CPU)\n");
+    fprintf(stderr, "  --latency-target MS        with --adaptive, back off when commands run longer than MS\n");
+    fprintf(stderr, "  --psi-target PCT           with --adaptive, back off when cpu/io/memory stall time is\n"
+    		        "                             above PCT percent (default: 10)\n");
+    fprintf(stderr, "  --metrics-file PATH        write metrics to PATH every second\n");
+    fprintf(stderr, "  --zygote                   start commands from a helper process forked at startup\n");
+    fprintf(stderr, "  --reader-cpu N             run filemon on CPU N, and commands on the other CPUs\n");
+    fprintf(stderr, "  --workers N                run plugins on N threads (default: one per CPU)\n");
+    fprintf(stderr, "  --readers N                read events on N threads pinned to CPUs, each one with its own\n"
+    		        "                             inotify instance and a share of the directories\n");
+    fprintf(stderr, "  --rules FILE               read rules from FILE; the rule options below make the last rule\n");
+    fprintf(stderr, "  --include PATTERN          ignore events about files whose name does not match PATTERN\n"
+    		        "                             (any of the --include patterns)\n");
+    fprintf(stderr, "  --exclude PATTERN          ignore events about files whose name matches PATTERN\n");
+    fprintf(stderr, "  --exclude-temp             ignore temporary files: *.swp *.swx *.part *.tmp *~ .#*\n");
+    fprintf(stderr, "  --prefetch BYTES           read ahead the files of queued jobs, up to BYTES (K, M, G) of page cache\n");
+    fprintf(stderr, "rule options:\n");
+
+    for (size_t i = 0; i < RULE_OPTIONS; i++) {
+    	char opt_str[64];
+
+    	snprintf(opt_str, sizeof(opt_str), "--%s %s", rule_options[i].key, rule_options[i].arg);
+    	fprintf(stderr, "  %-26s %s\n", opt_str, rule_options[i].help);
+    }
 }
 
 
+enum {
+	OPT_ADAPTIVE = 256,
+	OPT_LATENCY_TARGET,
+	OPT_PSI_TARGET,
+	OPT_METRICS_FILE,
+	OPT_ZYGOTE,
+	OPT_READER_CPU,
+	OPT_WORKERS,
+	OPT_RULES,
+	OPT_INCLUDE,
+	OPT_EXCLUDE,
+	OPT_EXCLUDE_TEMP,
+	OPT_PREFETCH,
+	OPT_READERS,
+	OPT_RULE,                   // OPT_RULE + i: rule_options[i]
+};
+
+static const struct option main_options[] = {
+		{ "jobs",           required_argument, NULL, 'j' },
+		{ "adaptive",       no_argument,       NULL, OPT_ADAPTIVE },
+		{ "latency-target", required_argument, NULL, OPT_LATENCY_TARGET },
+		{ "psi-target",     required_argument, NULL, OPT_PSI_TARGET },
+		{ "metrics-file",   required_argument, NULL, OPT_METRICS_FILE },
+		{ "zygote",         no_argument,       NULL, OPT_ZYGOTE },
+		{ "reader-cpu",     required_argument, NULL, OPT_READER_CPU },
+		{ "workers",        required_argument, NULL, OPT_WORKERS },
+		{ "rules",          required_argument, NULL, OPT_RULES },
+		{ "include",        required_argument, NULL, OPT_INCLUDE },
+		{ "exclude",        required_argument, NULL, OPT_EXCLUDE },
+		{ "exclude-temp",   no_argument,       NULL, OPT_EXCLUDE_TEMP },
+		{ "prefetch",       required_argument, NULL, OPT_PREFETCH },
+		{ "readers",        required_argument, NULL, OPT_READERS },
+};
+
+#define MAIN_OPTIONS (sizeof(main_options) / sizeof(main_options[0]))
+
+// main_options followed by one option for each rule setting
+static struct option long_options[MAIN_OPTIONS + RULE_OPTIONS + 1];
+
+static void build_long_options(void)
+{
+	memcpy(long_options, main_options, sizeof(main_options));
+
+	for (size_t i = 0; i < RULE_OPTIONS; i++) {
+		struct option * o = &long_options[MAIN_OPTIONS + i];
+
+		o->name = rule_options[i].key;
+		o->has_arg = required_argument;
+		o->flag = NULL;
+		o->val = OPT_RULE + i;
+	}
+
+	memset(&long_options[MAIN_OPTIONS + RULE_OPTIONS], 0, sizeof(struct option));
+}
+
 
 int main(int argc, char * argv[]) {
 
@@ -293,6 +6699,11 @@ int main(int argc, char * argv[]) {
     int dirs_len = 0;
     int dirs_counter = 0;
 
+    bool max_jobs_set = false;
+    bool rule_options_set = false;     // options of the rule of the command line
+
+    const char * rules_file = NULL;
+
     // array of strings containing absolute path of directories to monitor
     char_p * abs_dirs;
 
@@ -300,7 +6711,11 @@ int main(int argc, char * argv[]) {
 
     openlog(FILEMON, LOG_CONS | LOG_PERROR | LOG_PID, 0);
 
-    while ((opt = getopt(argc, argv, "d:c:")) != -1) {
+    default_rule = rule_new("default");
+
+    build_long_options();
+
+    while ((opt = getopt_long(argc, argv, "d:c:j:", long_options, NULL)) != -1) {
         switch (opt) {
         case 'd':
         	if (dirs_counter >= dirs_len) {
@@ -313,27 +6728,177 @@ int main(int argc, char * argv[]) {
         	        exit(EXIT_FAILURE);
         	    }
 
+        	    // unused slots are skipped by the loops below
+        	    for (int i = dirs_counter; i < dirs_len; i++)
+        	    	dirs[i] = NULL;
+
         	}
 
         	dirs[dirs_counter++] = optarg;
             break;
         case 'c':
-        	command = optarg;
+        	default_rule->command = optarg;
             break;
-        default: /* '?' */
+        case 'j':
+        	max_jobs = atoi(optarg);
+        	max_jobs_set = true;
+        	if (max_jobs < 1) {
+        		syslog(LOG_ERR, "invalid number of jobs: %s", optarg);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        case OPT_ADAPTIVE:
+        	adaptive = true;
+        	break;
+        case OPT_LATENCY_TARGET: {
+        	char * end;
+
+        	errno = 0;
+        	latency_target_ms = strtol(optarg, &end, 10);
+        	if (errno != 0 || end == optarg || *end != 0 || latency_target_ms < 1) {
+        		syslog(LOG_ERR, "invalid latency target: %s", optarg);
+        		show_help(argc, argv);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        }
+        case OPT_PSI_TARGET: {
+        	char * end;
+
+        	// a stall percentage: 0 would back off at any stall
+        	errno = 0;
+        	psi_target = strtod(optarg, &end);
+        	if (errno != 0 || end == optarg || *end != 0 || !(psi_target > 0 && psi_target <= 100)) {
+        		syslog(LOG_ERR, "invalid PSI target: %s", optarg);
+        		show_help(argc, argv);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        }
+        case OPT_METRICS_FILE:
+        	metrics_file = optarg;
+        	break;
+        case OPT_ZYGOTE:
+        	use_zygote = true;
+        	break;
+        case OPT_READER_CPU:
+        	reader_cpu = atoi(optarg);
+        	if (reader_cpu < 0 || reader_cpu >= CPU_SETSIZE) {
+        		syslog(LOG_ERR, "invalid CPU: %s", optarg);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        case OPT_RULES:
+        	rules_file = optarg;
+        	break;
+        case OPT_INCLUDE:
+        	filter_add(&includes, &includes_len, optarg);
+        	break;
+        case OPT_EXCLUDE:
+        	filter_add(&excludes, &excludes_len, optarg);
+        	break;
+        case OPT_EXCLUDE_TEMP:
+        	for (int i = 0; temp_patterns[i] != NULL; i++)
+        		filter_add(&excludes, &excludes_len, temp_patterns[i]);
+        	break;
+        case OPT_PREFETCH:
+        	if (parse_size(optarg, &prefetch_budget) == -1) {
+        		syslog(LOG_ERR, "invalid prefetch budget: %s", optarg);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        case OPT_READERS:
+        	readers = atoi(optarg);
+        	if (readers < 1) {
+        		syslog(LOG_ERR, "invalid number of readers: %s", optarg);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        case OPT_WORKERS:
+        	workers = atoi(optarg);
+        	if (workers < 1) {
+        		syslog(LOG_ERR, "invalid number of workers: %s", optarg);
+        		exit(EXIT_FAILURE);
+        	}
+        	break;
+        default:
+        	if (opt >= OPT_RULE && opt < OPT_RULE + (int) RULE_OPTIONS) {
+        		if (set_rule_option(default_rule, &rule_options[opt - OPT_RULE], optarg) == -1)
+        			exit(EXIT_FAILURE);
+        		rule_options_set = true;
+        		break;
+        	}
+
+        	/* '?' */
         	show_help(argc, argv);
 
             exit(EXIT_FAILURE);
         }
     }
 
-    if (command == NULL || dirs_len == 0) {
+    bool default_rule_set = default_rule->command != NULL || default_rule->plugin != NULL
+    		|| default_rule->action != ACTION_COMMAND;
+
+    if ((!default_rule_set && rules_file == NULL) || dirs_len == 0) {
     	show_help(argc, argv);
     	exit(EXIT_FAILURE);
     }
 
+    // the rule of the command line is dropped below: its options would be ignored silently
+    if (rules_file != NULL && !default_rule_set && rule_options_set) {
+    	syslog(LOG_ERR, "rule options on the command line need -c, --plugin or --action; "
+    			"without them, set the options in the rules of %s", rules_file);
+    	exit(EXIT_FAILURE);
+    }
+
+    if (rules_file != NULL) {
+    	rules_load(rules_file);
+
+    	// without -c, --plugin or --action only the rules of the file are used
+    	if (!default_rule_set) {
+    		rules_len--;
+    		memmove(rules, rules + 1, sizeof(struct rule *) * rules_len);
+    		default_rule = NULL;
+    	}
+    }
+
+    handler_env_init();
+
+    // the zygote is forked while the process is still small
+    if (use_zygote)
+    	zygote_start();
+
+    if (workers == 0) {
+    	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    	workers = cpus > 0 ? cpus : 1;
+    }
+
+    if (adaptive) {
+    	if (!max_jobs_set) {
+    		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    		max_jobs = 4 * (cpus > 0 ? cpus : 1);
+    	}
+
+    	// start from a single handler and let the controller find the right value
+    	concurrency_limit = 1;
+    } else {
+    	concurrency_limit = max_jobs;
+    }
+
+
+	for (int i = 0; i < rules_len; i++) {
+		if (rules[i]->plugin != NULL)
+			syslog(LOG_INFO,"rule %s: plugin: %s", rules[i]->name, rules[i]->plugin);
+		else if (rules[i]->action != ACTION_COMMAND)
+			syslog(LOG_INFO,"rule %s: action: %s", rules[i]->name, actions[rules[i]->action]);
+		else
+			syslog(LOG_INFO,"rule %s: command: %s", rules[i]->name, rules[i]->command);
+	}
 
-	syslog(LOG_INFO,"command: %s", command);
+	if (adaptive)
+		syslog(LOG_INFO,"adaptive concurrency, max jobs: %d", max_jobs);
+	else
+		syslog(LOG_INFO,"max jobs: %d", max_jobs);
 
     syslog(LOG_INFO,"number of specified files/directories: %d", dirs_counter);
 	for (int i = 0; i < dirs_len; i++) {
@@ -341,11 +6906,6 @@ int main(int argc, char * argv[]) {
 			syslog(LOG_INFO,"directory[%d]: %s", i, dirs[i]);
 	}
 
-	if (strlen(command) > MAX_COMMAND_LEN) {
-		syslog(LOG_ERR, "invalid command");
-		exit(EXIT_FAILURE);
-	}
-
 	if (dirs_len > 0) {
 
 		// transform paths to absolute paths
@@ -371,6 +6931,9 @@ int main(int argc, char * argv[]) {
 			}
 		}
 
+		for (int i = 0; i < rules_len; i++)
+			rule_open(rules[i]);
+
 		monitor(abs_dirs, dirs_len);
 	}
 
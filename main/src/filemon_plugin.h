@@ -0,0 +1,73 @@
+/*
+ * filemon_plugin.h
+ *
+ * ABI of filemon plugins: shared objects which filemon loads with dlopen() and
+ * calls from its worker threads instead of executing a command for each file.
+ *
+ * a plugin exports a symbol named FILEMON_PLUGIN_SYMBOL of type struct filemon_plugin:
+ *
+ *   const struct filemon_plugin filemon_plugin = {
+ *       .abi_version = FILEMON_PLUGIN_ABI_VERSION,
+ *       .name = "example",
+ *       .init = example_init,
+ *       .handle_batch = example_handle_batch,
+ *       .shutdown = example_shutdown,
+ *   };
+ *
+ * build: gcc -shared -fPIC -O2 -I filemon/main/src example.c -o example.so
+ */
+
+#ifndef FILEMON_PLUGIN_H_
+#define FILEMON_PLUGIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// incremented on every incompatible change of the structures below;
+// filemon refuses to load a plugin built for another version
+#define FILEMON_PLUGIN_ABI_VERSION 2
+
+#define FILEMON_PLUGIN_SYMBOL "filemon_plugin"
+
+// a file to process; strings and fd are valid only during handle_batch()
+struct filemon_event {
+	const char * path;          // absolute path of the file
+	const char * dir;           // watched directory
+	const char * name;          // file name, relative to dir
+	uint32_t mask;              // inotify mask of the event
+	int fd;                     // the file, open read only (rule pass-fd), or -1
+	uint64_t event_ts_ns;       // when filemon has read the event, ns since the epoch (CLOCK_REALTIME)
+	uint64_t queue_wait_ns;     // how long the event waited in the queue of its rule
+	int attempt;                // 1 for the first execution, incremented at every retry
+	const char * checksum;      // "algorithm:hex digits" (rule checksum), or NULL
+};
+
+struct filemon_plugin {
+	uint32_t abi_version;       // FILEMON_PLUGIN_ABI_VERSION
+
+	const char * name;
+
+	// called once, before any other function, from the main thread of filemon.
+	// args is the plugin-args setting of the rule (NULL if not set).
+	// returns the state passed to the other functions; *error set to non-zero makes
+	// filemon exit at startup
+	void * (*init)(const char * args, int * error);
+
+	// processes events[0] .. events[n - 1] and stores the outcome of each one in status[]:
+	// 0 = success, anything else = failure (the rule retry and dead letter settings apply).
+	// called from several worker threads at the same time: it must be thread safe.
+	void (*handle_batch)(void * state, const struct filemon_event * events, size_t n, int * status);
+
+	// called once when filemon terminates, after the last handle_batch() has returned; may be NULL
+	void (*shutdown)(void * state);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILEMON_PLUGIN_H_ */
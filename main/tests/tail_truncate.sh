@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# tail_truncate.sh
+#
+# checks that a file of a tail rule which is truncated and written again past the offset already
+# delivered, within one --tail-delay (copytruncate followed by new lines), is followed again from
+# offset 0: no byte written after the truncation is lost.
+#
+# usage: tail_truncate.sh FILEMON
+#
+# build:
+#   gcc -O2 main/src/filemon.c -o filemon -pthread -ldl
+#   main/tests/tail_truncate.sh ./filemon
+
+set -e
+
+FILEMON=$(realpath "$1")
+
+if [ ! -x "$FILEMON" ]; then
+	echo "usage: $0 FILEMON" >&2
+	exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$WORK"' EXIT
+
+dir="$WORK/in"
+out="$WORK/out"
+metrics="$WORK/metrics"
+
+mkdir "$dir"
+: > "$out"
+
+# prints the value of metric $1
+metric() {
+	awk -v name="$1" '$1 == name { print $2 }' "$metrics" 2>/dev/null
+}
+
+# fails if the bytes delivered are not $1
+expect() {
+	if [ "$(cat "$out")" != "$1" ]; then
+		echo "FAIL: $2: delivered '$(cat "$out")', expected '$1'" >&2
+		exit 1
+	fi
+	echo "ok: $2"
+}
+
+"$FILEMON" -d "$dir" --tail yes --tail-delay 500 --metrics-file "$metrics" -c "cat >> $out #" 2>/dev/null &
+pid=$!
+
+while [ ! -f "$metrics" ]; do sleep 0.1; done
+
+printf 'hello\n' > "$dir/app.log"
+sleep 1.5
+expect 'hello' "append"
+
+# truncated and written past the old offset (6) within the same tick
+: > "$dir/app.log"; printf 'after-trunc\n' >> "$dir/app.log"
+sleep 1.5
+expect $'hello\nafter-trunc' "truncate and append in one tick"
+
+# the same, with a shorter offset and more bytes written after the truncation
+printf 'ab\n' > "$dir/app.log"
+sleep 1.5
+: > "$dir/app.log"; printf 'abcdefghijklmnop\n' >> "$dir/app.log"
+sleep 1.5
+expect $'hello\nafter-trunc\nab\nabcdefghijklmnop' "truncate and append past a short offset"
+
+# the metrics file is written every second
+sleep 1.5
+if [ "$(metric 'filemon_rule_tail_truncations_total{rule="default"}')" -lt 3 ]; then
+	echo "FAIL: truncations not counted" >&2
+	exit 1
+fi
+echo "ok: truncations counted"